@@ -13,16 +13,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
 
 #include <zlib.h>
 
 #include "libstardict.h"
+#include "libstardict_priv.h"
 
-__attribute__ ((format (printf, 1, 2)))
-static char *sd_aprintf(const char *fmt, ...)
+char *sd_aprintf(const char *fmt, ...)
 {
 	va_list ap;
 	int len;
@@ -42,8 +43,7 @@ static char *sd_aprintf(const char *fmt, ...)
 	return tmp;
 }
 
-__attribute__ ((format (printf, 1, 2)))
-static void sd_err(const char *fmt, ...)
+void sd_err(const char *fmt, ...)
 {
 	va_list ap;
 
@@ -54,148 +54,395 @@ static void sd_err(const char *fmt, ...)
 	fprintf(stderr, "\n");
 }
 
-#define GZ_MAGIC1 0x1f
-#define GZ_MAGIC2 0x8b
-
-#define GZ_METHOD_DEFLATE 0x08
-
-#define GZ_FLAGS_CRC 0x02
-#define GZ_FLAGS_EXTRA_FIELD 0x04
-#define GZ_FLAGS_FNAME 0x08
-#define GZ_FLAGS_COMMENT 0x10
-
-#define DICT_DZ_MAGIC1 'R'
-#define DICT_DZ_MAGIC2 'A'
-
 struct chunk_pos {
 	uint16_t size;
 	off_t offset;
 };
 
+/* Default number of cached chunks */
 #define CHUNK_CACHE_SIZE 3
 
 struct cached_chunk {
 	uint16_t idx;
-	uint16_t hits;
+	/* set on a hit, cleared when passed by the clock hand */
+	uint8_t referenced;
 	void *data;
 };
 
 struct dict_dz {
 	int fd;
+	/* dict.dz mapping, set by sd_set_mmap() */
+	const uint8_t *map;
+	size_t map_size;
+	/* cache shared between processes, set by sd_set_shm_cache() */
+	struct sd_shm_cache *shm_cache;
 	uint16_t chunk_decomp_size;
 	uint16_t chunk_cnt;
-	struct cached_chunk chunk_cache[CHUNK_CACHE_SIZE];
+	/* protects chunk cache, entries may be read from multiple threads */
+	pthread_mutex_t cache_lock;
+	uint16_t cache_slots;
+	/* next slot to be considered for eviction */
+	uint16_t cache_hand;
+	struct cached_chunk *chunk_cache;
+	/* chunk index to cache slot + 1, zero if not cached */
+	uint16_t *cache_slot;
+	/* set if the dict.dz data are accessed randomly */
+	int advice_random;
+	struct sd_dict *dict;
 	struct chunk_pos chunks[];
 };
 
-static void *dict_gz_inflate_chunk(struct dict_dz *self, uint16_t idx)
+/*
+ * Inflates compressed chunk data into a buffer of chunk_decomp_size.
+ */
+static int dict_gz_inflate(struct dict_dz *self, uint16_t idx, const void *in, void *res)
 {
 	z_stream stream = {};
 	struct chunk_pos *chunk = &self->chunks[idx];
-	void *buf, *res;
 
 	if (inflateInit2(&stream, -15) != Z_OK) {
 		sd_err("Failed to initialize infalte %s", stream.msg);
-		return NULL;
-	}
-
-	buf = malloc(chunk->size);
-	res = malloc(self->chunk_decomp_size);
-	if (!buf || !res)
-		goto err0;
-
-	if (pread(self->fd, buf, chunk->size, chunk->offset) != chunk->size) {
-		sd_err("Failed to read compressed data");
-		goto err0;
+		return 1;
 	}
 
-	stream.next_in = buf;
+	stream.next_in = (void *)in;
 	stream.avail_in = chunk->size;
 	stream.next_out = res;
 	stream.avail_out = self->chunk_decomp_size;
 
+	SD_TRACE_BEGIN(inflate, self->dict, idx);
+
 	if (inflate(&stream, Z_PARTIAL_FLUSH) != Z_OK) {
 		sd_err("Failed to inflate chunk %s", stream.msg);
 		goto err0;
 	}
 
+	SD_TRACE_END(inflate, SD_TRACE_INFLATE, self->dict, idx);
+
 	if (stream.avail_in) {
 		sd_err("Input wasn't processed!");
 		goto err0;
 	}
 
+	SD_STAT_ADD(self->dict, bytes_decompressed, stream.total_out);
+
 	inflateEnd(&stream);
-	free(buf);
-	return res;
+	return 0;
 err0:
 	inflateEnd(&stream);
-	free(res);
+	return 1;
+}
+
+static int dict_gz_pread(struct dict_dz *self, uint16_t idx, void *buf,
+                         size_t size, off_t offset)
+{
+	SD_STAT_ADD(self->dict, read_calls, 1);
+
+	SD_TRACE_BEGIN(pread, self->dict, idx);
+
+	if (pread(self->fd, buf, size, offset) != (ssize_t)size) {
+		sd_err("Failed to read compressed data");
+		return 1;
+	}
+
+	SD_TRACE_END(pread, SD_TRACE_PREAD, self->dict, idx);
+
+	SD_STAT_ADD(self->dict, bytes_compressed, size);
+
+	return 0;
+}
+
+/*
+ * Maximal size of a single read from dict.dz.
+ */
+#define DICT_DZ_READ_MAX (1024 * 1024)
+
+static off_t dict_gz_chunk_end(struct dict_dz *self, uint16_t idx)
+{
+	return self->chunks[idx].offset + self->chunks[idx].size;
+}
+
+/*
+ * Returns compressed data of chunks [first, last]. The chunks are stored back
+ * to back in the file and are read by a single pread() into a newly allocated
+ * buffer or returned directly from the mapping if the file is mapped.
+ */
+static const uint8_t *dict_gz_load(struct dict_dz *self, uint16_t first, uint16_t last,
+                                   void **buf)
+{
+	off_t start = self->chunks[first].offset;
+	size_t size = dict_gz_chunk_end(self, last) - start;
+
+	*buf = NULL;
+
+	if (self->map) {
+		SD_STAT_ADD(self->dict, bytes_compressed, size);
+		return self->map + start;
+	}
+
+	*buf = malloc(size);
+	if (!*buf) {
+		sd_err("Failed to allocate read buffer");
+		return NULL;
+	}
+
+	if (dict_gz_pread(self, first, *buf, size, start)) {
+		free(*buf);
+		*buf = NULL;
+		return NULL;
+	}
+
+	return *buf;
+}
+
+/*
+ * Reads and inflates a chunk into a buffer of chunk_decomp_size.
+ */
+static int dict_gz_inflate_chunk_buf(struct dict_dz *self, uint16_t idx, void *res)
+{
+	const uint8_t *in;
+	void *buf;
+	int ret;
+
+	in = dict_gz_load(self, idx, idx, &buf);
+	if (!in)
+		return 1;
+
+	ret = dict_gz_inflate(self, idx, in, res);
+
 	free(buf);
-	return NULL;
+	return ret;
 }
 
-static void *dict_gz_chunk_cache_lookup(struct dict_dz *self, uint16_t idx)
+/*
+ * Sequential reader of compressed chunks up to the end offset, reads the file
+ * in large blocks and asks the kernel to prefetch the next block while the
+ * current one is being inflated.
+ */
+struct dict_dz_reader {
+	struct dict_dz *dz;
+	char *buf;
+	off_t start;
+	size_t len;
+	off_t end;
+};
+
+static int dict_dz_reader_init(struct dict_dz_reader *self, struct dict_dz *dz,
+                               off_t start, off_t end)
 {
-	uint16_t i;
+	self->dz = dz;
+	self->start = -1;
+	self->len = 0;
+	self->end = end;
+	self->buf = NULL;
 
-	for (i = 0; i < CHUNK_CACHE_SIZE; i++) {
-		if (!self->chunk_cache[i].data)
-			continue;
+	if (dz->map)
+		return 0;
 
-		if (self->chunk_cache[i].idx == idx) {
-			//TODO saturated increment
-			self->chunk_cache[i].hits++;
-			return self->chunk_cache[i].data;
-		}
+	self->buf = malloc(MIN(DICT_DZ_READ_MAX, end - start));
+	if (!self->buf) {
+		sd_err("Failed to allocate read buffer");
+		return 1;
+	}
+
+	return 0;
+}
+
+static const void *dict_dz_reader_chunk(struct dict_dz_reader *self, uint16_t idx)
+{
+	struct dict_dz *dz = self->dz;
+	struct chunk_pos *chunk = &dz->chunks[idx];
+
+	if (dz->map) {
+		SD_STAT_ADD(dz->dict, bytes_compressed, chunk->size);
+		return dz->map + chunk->offset;
+	}
+
+	if (chunk->offset >= self->start &&
+	    chunk->offset + chunk->size <= self->start + (off_t)self->len)
+		return self->buf + (chunk->offset - self->start);
+
+	self->start = chunk->offset;
+	self->len = MIN(DICT_DZ_READ_MAX, self->end - chunk->offset);
+
+	if (dict_gz_pread(dz, idx, self->buf, self->len, self->start)) {
+		self->len = 0;
+		return NULL;
+	}
+
+	if (self->start + (off_t)self->len < self->end) {
+		posix_fadvise(dz->fd, self->start + self->len,
+		              MIN(DICT_DZ_READ_MAX, self->end - self->start - self->len),
+		              POSIX_FADV_WILLNEED);
+	}
+
+	return self->buf;
+}
+
+static void dict_dz_reader_free(struct dict_dz_reader *self)
+{
+	free(self->buf);
+}
+
+static void *dict_gz_inflate_chunk(struct dict_dz *self, uint16_t idx)
+{
+	void *res = malloc(self->chunk_decomp_size);
+
+	if (!res)
+		return NULL;
+
+	if (dict_gz_inflate_chunk_buf(self, idx, res)) {
+		free(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+static struct cached_chunk *dict_gz_chunk_cache_find(struct dict_dz *self, uint16_t idx)
+{
+	uint16_t slot = self->cache_slot[idx];
+
+	if (!slot)
+		return NULL;
+
+	return &self->chunk_cache[slot - 1];
+}
+
+static void *dict_gz_chunk_cache_lookup(struct dict_dz *self, uint16_t idx)
+{
+	struct cached_chunk *cached = dict_gz_chunk_cache_find(self, idx);
+
+	if (cached) {
+		cached->referenced = 1;
+		SD_STAT_ADD(self->dict, cache_hits, 1);
+		return cached->data;
 	}
 
+	SD_STAT_ADD(self->dict, cache_misses, 1);
+
 	return NULL;
 }
 
+/*
+ * The victim is chosen by the CLOCK algorithm, the hand skips and clears
+ * slots that were hit since it passed them the last time. Each slot is
+ * skipped at most once, so the eviction is O(1) amortized.
+ */
 static void dict_gz_chunk_cache_insert(struct dict_dz *self, void *data, uint16_t idx)
 {
-	uint16_t i;
-	uint16_t min_hits = self->chunk_cache[0].hits;
-	uint16_t min_hits_i = 0;
+	struct cached_chunk *victim;
+
+	for (;;) {
+		victim = &self->chunk_cache[self->cache_hand];
+
+		if (++self->cache_hand >= self->cache_slots)
+			self->cache_hand = 0;
 
-	for (i = 0; i < CHUNK_CACHE_SIZE; i++) {
-		if (!self->chunk_cache[i].data) {
-			min_hits_i = i;
+		if (!victim->data)
 			goto insert;
-		}
 
-		if (self->chunk_cache[i].hits < min_hits) {
-			min_hits = self->chunk_cache[i].hits;
-			min_hits_i = 0;
-		}
+		if (!victim->referenced)
+			break;
+
+		victim->referenced = 0;
 	}
 
+	SD_STAT_ADD(self->dict, cache_evictions, 1);
+	self->cache_slot[victim->idx] = 0;
+	free(victim->data);
 insert:
-	free(self->chunk_cache[min_hits_i].data);
-	self->chunk_cache[min_hits_i].data = data;
-	self->chunk_cache[min_hits_i].idx = idx;
-	self->chunk_cache[min_hits_i].hits = 1;
+	victim->data = data;
+	victim->idx = idx;
+	victim->referenced = 1;
+	self->cache_slot[idx] = victim - self->chunk_cache + 1;
 }
 
 static void dict_dz_chunk_cache_free(struct dict_dz *self)
 {
 	uint16_t i;
 
-	for (i = 0; i < CHUNK_CACHE_SIZE; i++)
+	if (!self->chunk_cache)
+		return;
+
+	for (i = 0; i < self->cache_slots; i++)
 		free(self->chunk_cache[i].data);
+
+	free(self->chunk_cache);
+	free(self->cache_slot);
+
+	self->chunk_cache = NULL;
+	self->cache_slot = NULL;
 }
 
-static void dict_dz_chunk_cache_init(struct dict_dz *self)
+/*
+ * Allocates an empty cache with at least one slot and at most one slot per
+ * chunk.
+ */
+static int dict_dz_chunk_cache_init(struct dict_dz *self, size_t slots)
 {
-	uint16_t i;
+	slots = MAX(1u, MIN(slots, self->chunk_cnt));
+
+	self->chunk_cache = calloc(slots, sizeof(struct cached_chunk));
+	self->cache_slot = calloc(MAX(1u, self->chunk_cnt), sizeof(uint16_t));
+
+	if (!self->chunk_cache || !self->cache_slot) {
+		sd_err("Failed to allocate chunk cache");
+		free(self->chunk_cache);
+		free(self->cache_slot);
+		self->chunk_cache = NULL;
+		self->cache_slot = NULL;
+		return 1;
+	}
+
+	self->cache_slots = slots;
+	self->cache_hand = 0;
+
+	return 0;
+}
+
+/*
+ * Moves the cached chunks into a cache with a different number of slots, the
+ * chunks that were hit since the clock hand passed them are kept first.
+ */
+static int dict_dz_chunk_cache_resize(struct dict_dz *self, size_t slots)
+{
+	struct cached_chunk *chunk_cache, *old = self->chunk_cache;
+	uint16_t i, old_slots = self->cache_slots, cnt = 0;
+	int referenced;
+
+	slots = MAX(1u, MIN(slots, self->chunk_cnt));
+
+	chunk_cache = calloc(slots, sizeof(struct cached_chunk));
+	if (!chunk_cache) {
+		sd_err("Failed to allocate chunk cache");
+		return 1;
+	}
+
+	for (referenced = 1; referenced >= 0; referenced--) {
+		for (i = 0; i < old_slots; i++) {
+			if (!old[i].data || old[i].referenced != referenced)
+				continue;
+
+			if (cnt < slots) {
+				chunk_cache[cnt] = old[i];
+				self->cache_slot[old[i].idx] = ++cnt;
+			} else {
+				self->cache_slot[old[i].idx] = 0;
+				free(old[i].data);
+			}
+		}
+	}
+
+	free(old);
 
-	for (i = 0; i < CHUNK_CACHE_SIZE; i++)
-		self->chunk_cache[i].data = NULL;
+	self->chunk_cache = chunk_cache;
+	self->cache_slots = slots;
+	self->cache_hand = cnt < slots ? cnt : 0;
+
+	return 0;
 }
 
-#define GZIP_HEADER_SIZE 10
-#define EXTRA_HEADER_SIZE 12
-#define HEADER_SIZE (GZIP_HEADER_SIZE + EXTRA_HEADER_SIZE)
 #define MAX_COMMENTS 1024
 
 /**
@@ -230,45 +477,36 @@ static void dict_dz_chunk_cache_init(struct dict_dz *self)
  * [data chunk 2]
  * ...
  */
-static struct dict_dz *parse_dict_dz(const char *dict_path)
+static struct dict_dz *dict_dz_new(const uint8_t *header, size_t header_size,
+                                   off_t file_size, struct sd_dict *dict)
 {
-	int fd;
-	off_t header_map_size = getpagesize();
-
-	fd = open(dict_path, O_RDONLY);
-	if (!fd) {
-		sd_err("Failed to open dict.dz file");
+	if (header_size < HEADER_SIZE) {
+		sd_err("File dict.dz is too short");
 		return NULL;
 	}
 
-	uint8_t *header = mmap(NULL, header_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (header == MAP_FAILED) {
-		sd_err("Failed to map dict.dz file");
-		goto err0;
-	}
-
 	if (header[0] != GZ_MAGIC1 || header[1] != GZ_MAGIC2) {
 		sd_err("File dict.dz has wrong gzip magic");
-		goto err1;
+		return NULL;
 	}
 
 	if (header[2] != GZ_METHOD_DEFLATE) {
 		sd_err("File dict.dz unsupported compression method");
-		goto err1;
+		return NULL;
 	}
 
 	uint8_t flags = header[3];
 
 	if (!(flags & GZ_FLAGS_EXTRA_FIELD)) {
 		sd_err("File dict.dz does not have extra field");
-		goto err1;
+		return NULL;
 	}
 
 	uint16_t extra_field_len = header[10] | header[11]<<8;
 
 	if (header[12] != DICT_DZ_MAGIC1 || header[13] != DICT_DZ_MAGIC2) {
 		sd_err("File dict.dz has wrong dz magic");
-		goto err1;
+		return NULL;
 	}
 
 	uint16_t version = header[16] | header[17] << 8;
@@ -278,40 +516,40 @@ static struct dict_dz *parse_dict_dz(const char *dict_path)
 	if (version != 1)
 		sd_err("Invalid version");
 
-	if (chunk_cnt > (header_map_size-HEADER_SIZE-MAX_COMMENTS) / 2) {
-		size_t new_map_size = (size_t)chunk_cnt * 2 + HEADER_SIZE + MAX_COMMENTS;
-
-		header = mremap(header, header_map_size, new_map_size, MREMAP_MAYMOVE);
-		if (!header) {
-			sd_err("Failed to remap dict.dz file");
-			goto err1;
-		}
+	if (!chunk_len) {
+		sd_err("File dict.dz has zero chunk length");
+		return NULL;
+	}
 
-		header_map_size = new_map_size;
+	if (HEADER_SIZE + (size_t)chunk_cnt * 2 > header_size) {
+		sd_err("File dict.dz chunk table is truncated");
+		return NULL;
 	}
 
 	struct dict_dz *res = malloc(sizeof(struct dict_dz) + sizeof(struct chunk_pos) * chunk_cnt);
 	if (!res) {
 		sd_err("Failed to allocate dict.dz description");
-		goto err1;
+		return NULL;
 	}
 
-	res->fd = fd;
+	res->dict = dict;
+	res->fd = -1;
 	res->chunk_cnt = chunk_cnt;
 	res->chunk_decomp_size = chunk_len;
-
-	dict_dz_chunk_cache_init(res);
+	res->map = NULL;
+	res->shm_cache = NULL;
+	res->advice_random = 0;
 
 	off_t offset = GZIP_HEADER_SIZE + extra_field_len + 2;
 
 	if (flags & GZ_FLAGS_FNAME) {
-		while (offset < header_map_size && header[offset])
+		while (offset < (off_t)header_size && header[offset])
 			offset++;
 		offset++;
 	}
 
 	if (flags & GZ_FLAGS_COMMENT) {
-		while (offset < header_map_size && header[offset])
+		while (offset < (off_t)header_size && header[offset])
 			offset++;
 		offset++;
 	}
@@ -319,9 +557,9 @@ static struct dict_dz *parse_dict_dz(const char *dict_path)
 	if (flags & GZ_FLAGS_CRC)
 		offset+=2;
 
-	if (offset >= header_map_size) {
-	       sd_err("File dict.dz header comments too long");
-               goto err2;
+	if (offset >= (off_t)header_size) {
+		sd_err("File dict.dz header comments too long");
+		goto err;
 	}
 
 	uint16_t i;
@@ -332,508 +570,1970 @@ static struct dict_dz *parse_dict_dz(const char *dict_path)
 		offset += res->chunks[i].size;
 	}
 
-	munmap(header, header_map_size);
+	if (offset > file_size) {
+		sd_err("File dict.dz is truncated");
+		goto err;
+	}
+
+	if (dict_dz_chunk_cache_init(res, CHUNK_CACHE_SIZE))
+		goto err;
+
+	pthread_mutex_init(&res->cache_lock, NULL);
 
 	return res;
-err2:
+err:
 	free(res);
-err1:
-	munmap(header, header_map_size);
-err0:
-	close(fd);
 	return NULL;
 }
 
-static void *dict_gz_get_chunk(struct dict_dz *self, uint16_t idx)
-{
-	void *chunk;
+/*
+ * Chunk table with the maximal number of chunks followed by the file name and
+ * comment, longer headers are not supported.
+ */
+#define HEADER_MAX (HEADER_SIZE + 2 * UINT16_MAX + MAX_COMMENTS)
 
-	chunk = dict_gz_chunk_cache_lookup(self, idx);
-	if (chunk)
-		return chunk;
+/*
+ * Parses the dict.dz file header, the file descriptor is owned by the result
+ * and closed on a failure.
+ */
+static struct dict_dz *parse_dict_dz_fd(int fd, struct sd_dict *dict)
+{
+	struct dict_dz *res = NULL;
+	size_t header_size;
+	struct stat st;
+	void *header;
 
-	chunk = dict_gz_inflate_chunk(self, idx);
-	if (!chunk)
+	if (fd < 0) {
+		sd_err("Failed to open dict.dz file: %s", strerror(errno));
 		return NULL;
+	}
 
-	dict_gz_chunk_cache_insert(self, chunk, idx);
+	if (fstat(fd, &st)) {
+		sd_err("Failed to stat dict.dz file: %s", strerror(errno));
+		goto exit;
+	}
 
-	return chunk;
-}
+	header_size = MIN((size_t)st.st_size, HEADER_MAX);
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+	if (!header_size) {
+		sd_err("File dict.dz is empty");
+		goto exit;
+	}
 
-static int dict_gz_read(struct dict_dz *self, char *buf, uint64_t offset, uint32_t size)
+	header = mmap(NULL, header_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (header == MAP_FAILED) {
+		sd_err("Failed to map dict.dz file");
+		goto exit;
+	}
+
+	res = dict_dz_new(header, header_size, st.st_size, dict);
+
+	munmap(header, header_size);
+
+	if (res)
+		res->fd = fd;
+exit:
+	if (!res)
+		close(fd);
+
+	return res;
+}
+
+static struct dict_dz *parse_dict_dz(const char *dict_path, struct sd_dict *dict)
 {
-	uint32_t first_chunk = offset / self->chunk_decomp_size;
-	uint32_t first_chunk_off = offset - first_chunk * self->chunk_decomp_size;
-	uint32_t first_chunk_size = MIN(size, self->chunk_decomp_size - first_chunk_off);
-	uint32_t last_chunk = (offset + size) / self->chunk_decomp_size;
-	uint32_t i;
+	return parse_dict_dz_fd(open(dict_path, O_RDONLY | O_CLOEXEC), dict);
+}
 
-	if (first_chunk >= self->chunk_cnt || last_chunk >= self->chunk_cnt) {
-		sd_err("[offset, offset + size] out of data");
-		return 1;
-	}
+/*
+ * The dict.dz data are read from the buffer the same way as from a mapped
+ * file, the buffer is owned by the caller.
+ */
+static struct dict_dz *parse_dict_dz_mem(const void *buf, size_t size, struct sd_dict *dict)
+{
+	struct dict_dz *res = dict_dz_new(buf, MIN(size, HEADER_MAX), size, dict);
 
-	/* Copy start of the data from the first chunk */
-	void *chunk = dict_gz_get_chunk(self, first_chunk);
-	if (!chunk)
-		return 1;
+	if (!res)
+		return NULL;
 
-	memcpy(buf, chunk + first_chunk_off, first_chunk_size);
+	res->map = buf;
+	res->map_size = size;
 
-	buf += first_chunk_size;
-	size -= first_chunk_size;
+	return res;
+}
 
-	if (first_chunk == last_chunk)
-		return 0;
+static void dict_gz_memcpy(struct dict_dz *self, void *dst, const void *src, size_t size)
+{
+	SD_TRACE_BEGIN(memcpy, self->dict, size);
 
-	/* Copy middle chunks if read spans more than two chunks */
-	for (i = first_chunk+1; i < last_chunk; i++) {
-		chunk = dict_gz_get_chunk(self, i);
-		if (!chunk)
-			return 1;
+	memcpy(dst, src, size);
 
-		memcpy(buf, chunk, self->chunk_decomp_size);
-		buf += self->chunk_decomp_size;
-		size -= self->chunk_decomp_size;
-	}
+	SD_TRACE_END(memcpy, SD_TRACE_MEMCPY, self->dict, size);
+}
 
-	/* Copy the rest from the last chunk */
-	chunk = dict_gz_get_chunk(self, last_chunk);
-	if (!chunk)
+/*
+ * Copies data from a chunk. The chunk cache is shared between threads, the
+ * data are copied from cached chunks under the lock, while missing chunks are
+ * inflated outside of it.
+ */
+static int dict_gz_shm_copy(struct dict_dz *self, uint16_t idx, void *dst,
+                            uint32_t off, uint32_t size)
+{
+	if (!self->shm_cache)
 		return 1;
 
-	memcpy(buf, chunk, size);
+	if (sd_shm_cache_copy(self->shm_cache, idx, dst, off, size)) {
+		SD_STAT_ADD(self->dict, shm_misses, 1);
+		return 1;
+	}
 
+	SD_STAT_ADD(self->dict, shm_hits, 1);
 	return 0;
 }
 
-static void destroy_dict_dz(struct dict_dz *self)
+static void dict_gz_shm_put(struct dict_dz *self, uint16_t idx, const void *chunk)
 {
-	dict_dz_chunk_cache_free(self);
-	close(self->fd);
-	free(self);
+	if (self->shm_cache)
+		sd_shm_cache_put(self->shm_cache, idx, chunk);
 }
 
-static int parse_ifo(const char *path, const char *fname, struct sd_dict *dict)
+/*
+ * Copies data from the process chunk cache or from the shared one, returns
+ * non-zero on a miss.
+ */
+static int dict_gz_copy_cached(struct dict_dz *self, uint16_t idx, void *dst,
+                               uint32_t off, uint32_t size)
 {
-	char *ifo_path = sd_aprintf("%s/%s.ifo", path, fname);
-	FILE *ifo;
-	char line[256];
-	int ret = 1;
-
-	if (!ifo_path)
-		goto err0;
+	void *chunk;
 
-	ifo = fopen(ifo_path, "r");
-	if (!ifo) {
-		sd_err("Failed to open '%s': %s", ifo_path, strerror(errno));
-		goto err0;
-	}
+	pthread_mutex_lock(&self->cache_lock);
 
-	if (!fgets(line, sizeof(line), ifo))
-		goto err1;
+	chunk = dict_gz_chunk_cache_lookup(self, idx);
+	if (chunk)
+		dict_gz_memcpy(self, dst, chunk + off, size);
 
-	if (strcmp(line, "StarDict's dict ifo file\n")) {
-		sd_err("Invalid ifo file signature");
-		goto err1;
-	}
+	pthread_mutex_unlock(&self->cache_lock);
 
-	while (fgets(line, sizeof(line), ifo)) {
+	if (chunk)
+		return 0;
+
+	return dict_gz_shm_copy(self, idx, dst, off, size);
+}
+
+static void dict_gz_cache_put(struct dict_dz *self, uint16_t idx, void *chunk)
+{
+	dict_gz_shm_put(self, idx, chunk);
+
+	pthread_mutex_lock(&self->cache_lock);
+
+	/* The chunk may have been inserted by another thread meanwhile */
+	if (dict_gz_chunk_cache_find(self, idx))
+		free(chunk);
+	else
+		dict_gz_chunk_cache_insert(self, chunk, idx);
+
+	pthread_mutex_unlock(&self->cache_lock);
+}
+
+/*
+ * Inflates a chunk from compressed data, copies a part of it and inserts the
+ * chunk into the cache.
+ */
+static int dict_gz_inflate_cached(struct dict_dz *self, uint16_t idx, const void *in,
+                                  void *dst, uint32_t off, uint32_t size)
+{
+	void *chunk = malloc(self->chunk_decomp_size);
+
+	if (!chunk)
+		return 1;
+
+	if (dict_gz_inflate(self, idx, in, chunk)) {
+		free(chunk);
+		return 1;
+	}
+
+	dict_gz_memcpy(self, dst, chunk + off, size);
+
+	dict_gz_cache_put(self, idx, chunk);
+
+	return 0;
+}
+
+static int dict_gz_copy_chunk(struct dict_dz *self, uint16_t idx, void *dst,
+                              uint32_t off, uint32_t size)
+{
+	void *chunk;
+
+	if (!dict_gz_copy_cached(self, idx, dst, off, size))
+		return 0;
+
+	chunk = dict_gz_inflate_chunk(self, idx);
+	if (!chunk)
+		return 1;
+
+	dict_gz_memcpy(self, dst, chunk + off, size);
+
+	dict_gz_cache_put(self, idx, chunk);
+
+	return 0;
+}
+
+/*
+ * The first and the last chunk may be shared with neighbouring entries and go
+ * through the cache, the chunks in between belong to the entry only and are
+ * inflated directly into the buffer. Consecutive chunks that are not cached
+ * are read by a single pread().
+ */
+static int dict_gz_read(struct dict_dz *self, char *buf, uint64_t offset, uint32_t size)
+{
+	uint32_t chunk_size = self->chunk_decomp_size;
+	uint32_t first_chunk = offset / chunk_size;
+	uint32_t first_chunk_off = offset - first_chunk * chunk_size;
+	uint32_t first_chunk_size = MIN(size, chunk_size - first_chunk_off);
+	uint32_t last_chunk = (offset + size - 1) / chunk_size;
+	uint32_t last_chunk_size, i, j, run_last;
+	char *last_buf;
+
+	if (!size)
+		return 0;
+
+	if (first_chunk >= self->chunk_cnt || last_chunk >= self->chunk_cnt) {
+		sd_err("[offset, offset + size] out of data");
+		return 1;
+	}
+
+	if (first_chunk == last_chunk)
+		return dict_gz_copy_chunk(self, first_chunk, buf, first_chunk_off, size);
+
+#define MIDDLE_CHUNK(i) (buf + first_chunk_size + ((i) - first_chunk - 1) * chunk_size)
+
+	last_buf = MIDDLE_CHUNK(last_chunk);
+	last_chunk_size = buf + size - last_buf;
+
+	i = first_chunk;
+	j = last_chunk;
+
+	if (!dict_gz_copy_cached(self, first_chunk, buf, first_chunk_off, first_chunk_size))
+		i++;
+
+	if (!dict_gz_copy_cached(self, last_chunk, last_buf, 0, last_chunk_size))
+		j--;
+
+	while (i <= j) {
+		const uint8_t *in;
+		void *tmp;
+		int ret;
+
+		/* Middle chunks may have been inflated by another process */
+		if (i != first_chunk && i != last_chunk &&
+		    !dict_gz_shm_copy(self, i, MIDDLE_CHUNK(i), 0, chunk_size)) {
+			i++;
+			continue;
+		}
+
+		for (run_last = i; run_last < j; run_last++) {
+			if (dict_gz_chunk_end(self, run_last + 1) - self->chunks[i].offset > DICT_DZ_READ_MAX)
+				break;
+
+			if (self->shm_cache && run_last + 1 != last_chunk &&
+			    sd_shm_cache_has(self->shm_cache, run_last + 1))
+				break;
+		}
+
+		in = dict_gz_load(self, i, run_last, &tmp);
+		if (!in)
+			return 1;
+
+		for (; i <= run_last; i++) {
+			if (i == first_chunk)
+				ret = dict_gz_inflate_cached(self, i, in, buf, first_chunk_off, first_chunk_size);
+			else if (i == last_chunk)
+				ret = dict_gz_inflate_cached(self, i, in, last_buf, 0, last_chunk_size);
+			else
+				ret = dict_gz_inflate(self, i, in, MIDDLE_CHUNK(i));
+
+			if (ret) {
+				free(tmp);
+				return 1;
+			}
+
+			if (i != first_chunk && i != last_chunk)
+				dict_gz_shm_put(self, i, MIDDLE_CHUNK(i));
+
+			in += self->chunks[i].size;
+		}
+
+		free(tmp);
+	}
+
+	return 0;
+#undef MIDDLE_CHUNK
+}
+
+/*
+ * Disables the read ahead for both reads and the mapping, the entries are
+ * small and scattered over the file.
+ */
+static void dict_dz_advise_random(struct dict_dz *self)
+{
+	self->advice_random = 1;
+
+	if (self->fd >= 0)
+		posix_fadvise(self->fd, 0, 0, POSIX_FADV_RANDOM);
+
+	if (self->map)
+		madvise((void *)self->map, self->map_size, MADV_RANDOM);
+}
+
+static void destroy_dict_dz(struct dict_dz *self)
+{
+	if (!self)
+		return;
+
+	dict_dz_chunk_cache_free(self);
+	pthread_mutex_destroy(&self->cache_lock);
+
+	/* Checks the dict.dz file identity, has to be done before the close */
+	sd_shm_cache_close(self->shm_cache);
+
+	/* In memory dictionaries have no fd and the buffer is not ours */
+	if (self->fd >= 0) {
+		if (self->map)
+			munmap((void *)self->map, self->map_size);
+
+		close(self->fd);
+	}
+
+	free(self);
+}
+
+/*
+ * Reads the whole file from the start regardless of the file offset.
+ */
+static int pread_all(int fd, void *buf, size_t size)
+{
+	size_t off = 0;
+
+	while (off < size) {
+		ssize_t ret = pread(fd, (char *)buf + off, size - off, off);
+
+		if (ret <= 0)
+			return 1;
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies a line into a null terminated buffer, lines longer than the buffer are
+ * split the same way fgets() would do. The file buffer does not have to be
+ * null terminated.
+ */
+static int ifo_line(const char **buf, const char *end, char *line, size_t size)
+{
+	const char *nl;
+	size_t len;
+
+	if (*buf >= end)
+		return 0;
+
+	nl = memchr(*buf, '\n', end - *buf);
+	len = MIN((size_t)((nl ? nl + 1 : end) - *buf), size - 1);
+
+	memcpy(line, *buf, len);
+	line[len] = 0;
+	*buf += len;
+
+	return 1;
+}
+
+static int parse_ifo_buf(const char *buf, size_t size, struct sd_dict *dict)
+{
+	const char *end = buf + size;
+	char line[256];
+
+	if (!ifo_line(&buf, end, line, sizeof(line)))
+		return 1;
+
+	if (strcmp(line, IFO_MAGIC)) {
+		sd_err("Invalid ifo file signature");
+		return 1;
+	}
+
+	while (ifo_line(&buf, end, line, sizeof(line))) {
 		sscanf(line, "wordcount=%u\n", &dict->word_count);
+		sscanf(line, "synwordcount=%u\n", &dict->syn_count);
 		sscanf(line, "idxfilesize=%u\n", &dict->idx_filesize);
 		sscanf(line, "sametypesequence=%c\n", &dict->entry_fmt);
 		sscanf(line, "bookname=%63[^\n]s\n", dict->book_name);
 	}
 
-	if (!dict->word_count) {
-		sd_err("Missing wordcount in ifo file");
-		goto err1;
-	}
+	if (!dict->word_count) {
+		sd_err("Missing wordcount in ifo file");
+		return 1;
+	}
+
+	if (!dict->idx_filesize) {
+		sd_err("Missing idxfilesize in ifo file");
+		return 1;
+	}
+
+	if (!dict->entry_fmt) {
+		sd_err("Unsupported file wihout sametypesequence");
+		return 1;
+	}
+
+	if (!dict->book_name[0]) {
+		sd_err("Missing bookname in ifo file");
+		return 1;
+	}
+
+	return 0;
+}
+
+#define IFO_SIZE_MAX (64 * 1024)
+
+static int parse_ifo_fd(int fd, struct sd_dict *dict)
+{
+	struct stat st;
+	char *buf;
+	int ret;
+
+	if (fstat(fd, &st)) {
+		sd_err("Failed to stat ifo file: %s", strerror(errno));
+		return 1;
+	}
+
+	if (st.st_size > IFO_SIZE_MAX) {
+		sd_err("Ifo file too large");
+		return 1;
+	}
+
+	buf = malloc(st.st_size);
+	if (!buf && st.st_size) {
+		sd_err("Failed to allocate ifo buffer");
+		return 1;
+	}
+
+	if (pread_all(fd, buf, st.st_size)) {
+		sd_err("Failed to read ifo file");
+		free(buf);
+		return 1;
+	}
+
+	ret = parse_ifo_buf(buf, st.st_size, dict);
+
+	free(buf);
+	return ret;
+}
+
+static int parse_ifo(const char *path, const char *fname, struct sd_dict *dict)
+{
+	char *ifo_path = sd_aprintf("%s/%s.ifo", path, fname);
+	int fd, ret;
+
+	if (!ifo_path)
+		return 1;
+
+	fd = open(ifo_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		sd_err("Failed to open '%s': %s", ifo_path, strerror(errno));
+		free(ifo_path);
+		return 1;
+	}
+
+	ret = parse_ifo_fd(fd, dict);
+
+	close(fd);
+	free(ifo_path);
+	return ret;
+}
+
+static unsigned int syn_word_idx(const char *syn)
+{
+	const uint8_t *bytes = (const uint8_t *)syn + strlen(syn) + 1;
+
+	return (unsigned int)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+/*
+ * The syn file is a sorted list of null terminated synonyms each followed by
+ * a 32bit big endian index of the word in the idx file.
+ */
+static int syn_list_fill(struct sd_dict *dict, char *syn, size_t size, unsigned int cnt)
+{
+	char *p = syn, *end = syn + size;
+	unsigned int i;
+
+	for (i = 0; p < end; i++) {
+		char *nul = memchr(p, 0, end - p);
+
+		if (!nul || end - nul - 1 < 4) {
+			sd_err("Truncated syn file");
+			return 1;
+		}
+
+		if (i < cnt)
+			dict->syn_list[i] = p;
+
+		p = nul + 1 + 4;
+	}
+
+	if (i != cnt) {
+		sd_err("Synonym count %u does not match synwordcount=%u", i, cnt);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int syn_list_valid(struct sd_dict *dict)
+{
+	unsigned int i;
+
+	for (i = 0; i < dict->syn_count; i++) {
+		if (syn_word_idx(dict->syn_list[i]) >= dict->word_count) {
+			sd_err("Synonym '%s' index out of range", dict->syn_list[i]);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * How the idx and syn files are held in memory.
+ */
+enum dict_mem {
+	/* allocated, freed on close */
+	DICT_MEM_HEAP,
+	/* mapped file, unmapped on close */
+	DICT_MEM_MAP,
+	/* buffer passed to sd_open_dict_mem(), owned by the caller */
+	DICT_MEM_BORROWED,
+};
+
+static void dict_mem_release(void *ptr, size_t size, uint8_t mem)
+{
+	if (!ptr)
+		return;
+
+	switch (mem) {
+	case DICT_MEM_HEAP:
+		free(ptr);
+	break;
+	case DICT_MEM_MAP:
+		munmap(ptr, size);
+	break;
+	}
+}
+
+/*
+ * The synonyms are used directly from the file buffer. Broken syn files are
+ * ignored so that the dictionary is still usable.
+ */
+static void syn_load(struct sd_dict *dict, void *syn, size_t size, uint8_t mem)
+{
+	unsigned int cnt = dict->syn_count;
+
+	dict->syn_count = 0;
+
+	/* Count the synonyms if synwordcount= is missing in the ifo */
+	if (!cnt) {
+		char *p = syn, *end = p + size;
+
+		while (p < end && (p = memchr(p, 0, end - p))) {
+			p += 1 + 4;
+			cnt++;
+		}
+	}
+
+	dict->syn_list = malloc(sizeof(char *) * cnt);
+	if (!dict->syn_list) {
+		sd_err("Failed to allocate syn_list");
+		goto err;
+	}
+
+	if (syn_list_fill(dict, syn, size, cnt))
+		goto err;
+
+	dict->syn_count = cnt;
+
+	if (!syn_list_valid(dict))
+		goto err;
+
+	dict->syn = syn;
+	dict->syn_size = size;
+	dict->syn_mem = mem;
+
+	return;
+err:
+	free(dict->syn_list);
+	dict->syn_list = NULL;
+	dict->syn_count = 0;
+	dict_mem_release(syn, size, mem);
+}
+
+static void syn_load_fd(int fd, struct sd_dict *dict)
+{
+	struct stat st;
+	void *syn;
+
+	if (fstat(fd, &st) || !st.st_size) {
+		dict->syn_count = 0;
+		return;
+	}
+
+	syn = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (syn == MAP_FAILED) {
+		sd_err("Failed to map syn file: %s", strerror(errno));
+		dict->syn_count = 0;
+		return;
+	}
+
+	syn_load(dict, syn, st.st_size, DICT_MEM_MAP);
+}
+
+/*
+ * The syn file is optional.
+ */
+static void parse_syn(const char *syn_path, struct sd_dict *dict)
+{
+	int fd = open(syn_path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_err("Failed to open '%s': %s", syn_path, strerror(errno));
+
+		dict->syn_count = 0;
+		return;
+	}
+
+	syn_load_fd(fd, dict);
+
+	close(fd);
+}
+
+static int stat_id(char *buf, size_t size, const struct stat *st)
+{
+	return snprintf(buf, size, "%llx-%llx-%llx-%llx.%lx",
+	                (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+	                (unsigned long long)st->st_size, (unsigned long long)st->st_mtim.tv_sec,
+	                (long)st->st_mtim.tv_nsec) >= (int)size;
+}
+
+/*
+ * Identifies the idx and syn files the word lists were loaded from, used to
+ * name per dictionary cache files.
+ */
+static char *files_id(const struct stat *idx_st, const struct stat *syn_st)
+{
+	char idx_id[128], syn_id[128];
+
+	if (stat_id(idx_id, sizeof(idx_id), idx_st) ||
+	    stat_id(syn_id, sizeof(syn_id), syn_st))
+		return NULL;
+
+	return sd_aprintf("%s-%s", idx_id, syn_id);
+}
+
+/*
+ * Inflates a gzip compressed idx file from a buffer.
+ */
+static int idx_inflate(struct sd_dict *dict, const void *buf, size_t size)
+{
+	z_stream stream = {};
+	int ret;
+
+	dict->idx = malloc(dict->idx_filesize);
+	dict->idx_mem = DICT_MEM_HEAP;
+
+	if (!dict->idx) {
+		sd_err("Failed to allocate idx");
+		return 1;
+	}
+
+	if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+		sd_err("Failed to initialize inflate %s", stream.msg);
+		return 1;
+	}
+
+	stream.next_in = (void *)buf;
+	stream.avail_in = size;
+	stream.next_out = dict->idx;
+	stream.avail_out = dict->idx_filesize;
+
+	ret = inflate(&stream, Z_FINISH);
+
+	inflateEnd(&stream);
+
+	if (stream.avail_out || (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR)) {
+		sd_err("Failed to inflate index");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int is_gzip(const uint8_t *buf, size_t size)
+{
+	return size >= 2 && buf[0] == GZ_MAGIC1 && buf[1] == GZ_MAGIC2;
+}
+
+/*
+ * The advice is only a hint, failures, e.g. on kernels without transparent
+ * huge pages, are ignored.
+ */
+static void idx_advise(struct sd_dict *dict, unsigned int flags)
+{
+	if ((flags & SD_OPEN_IDX_WILLNEED) && dict->idx_mem == DICT_MEM_MAP)
+		madvise(dict->idx, dict->idx_filesize, MADV_WILLNEED);
+
+	if (flags & SD_OPEN_IDX_HUGEPAGE)
+		madvise(dict->idx, dict->idx_filesize, MADV_HUGEPAGE);
+}
+
+static int idx_map(int fd, off_t file_size, struct sd_dict *dict,
+                   unsigned int idx_mem, unsigned int flags)
+{
+	int map_flags = MAP_PRIVATE;
+	void *buf;
+
+	if (file_size < dict->idx_filesize) {
+		sd_err("Idx file is shorter than idxfilesize");
+		return 1;
+	}
+
+	if (idx_mem == SD_IDX_MMAP_POPULATE || idx_mem == SD_IDX_MMAP_LOCK)
+		map_flags |= MAP_POPULATE;
+
+	buf = mmap(NULL, dict->idx_filesize, PROT_READ, map_flags, fd, 0);
+	if (buf == MAP_FAILED) {
+		sd_err("Failed to map idx file: %s", strerror(errno));
+		return 1;
+	}
+
+	dict->idx = buf;
+	dict->idx_mem = DICT_MEM_MAP;
+
+	if (idx_mem == SD_IDX_MMAP_LOCK && mlock(buf, dict->idx_filesize)) {
+		sd_err("Failed to lock idx in memory: %s", strerror(errno));
+		return 1;
+	}
+
+	idx_advise(dict, flags);
+
+	return 0;
+}
+
+/*
+ * Plain idx file is mapped, compressed one is inflated into memory.
+ */
+static int idx_load_fd(int fd, struct sd_dict *dict)
+{
+	uint8_t magic[2];
+	struct stat st;
+	void *buf;
+	int ret;
+
+	if (fstat(fd, &st)) {
+		sd_err("Failed to stat idx file: %s", strerror(errno));
+		return 1;
+	}
+
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && is_gzip(magic, sizeof(magic))) {
+		buf = malloc(st.st_size);
+		if (!buf) {
+			sd_err("Failed to allocate idx buffer");
+			return 1;
+		}
+
+		if (pread_all(fd, buf, st.st_size)) {
+			sd_err("Failed to read idx file");
+			free(buf);
+			return 1;
+		}
+
+		ret = idx_inflate(dict, buf, st.st_size);
+
+		free(buf);
+		return ret;
+	}
+
+	return idx_map(fd, st.st_size, dict, SD_IDX_MMAP, 0);
+}
+
+static int idx_load_mem(const void *buf, size_t size, struct sd_dict *dict)
+{
+	if (is_gzip(buf, size))
+		return idx_inflate(dict, buf, size);
+
+	if (size < dict->idx_filesize) {
+		sd_err("Idx buffer is shorter than idxfilesize");
+		return 1;
+	}
+
+	dict->idx = (void *)buf;
+	dict->idx_mem = DICT_MEM_BORROWED;
+
+	return 0;
+}
+
+/*
+ * Each idx entry is a null terminated word followed by 32bit big endian entry
+ * offset and size.
+ */
+static char **word_list_fill(struct sd_dict *dict)
+{
+	char *p = dict->idx, *end = p + dict->idx_filesize;
+	char **word_list;
+	unsigned int i;
+
+	word_list = malloc(dict->word_count * sizeof(char *));
+	if (!word_list) {
+		sd_err("Failed to allocate word_list");
+		return NULL;
+	}
+
+	for (i = 0; i < dict->word_count; i++) {
+		char *nul = memchr(p, 0, end - p);
+
+		if (!nul || end - nul - 1 < 8) {
+			sd_err("Truncated idx file");
+			free(word_list);
+			return NULL;
+		}
+
+		word_list[i] = p;
+		p = nul + 1 + 8;
+	}
+
+	return word_list;
+}
+
+static int fill_word_list(struct sd_dict *dict)
+{
+	dict->word_list = word_list_fill(dict);
+
+	return !dict->word_list;
+}
+
+/*
+ * Returns the word list, lazily opened dictionaries build it on the first
+ * call. Threads racing on the first call may build it more than once, only
+ * one of the lists is kept.
+ */
+static char **get_word_list(struct sd_dict *self)
+{
+	char **word_list = __atomic_load_n(&self->word_list, __ATOMIC_ACQUIRE);
+	char **expected = NULL;
+
+	if (word_list)
+		return word_list;
+
+	word_list = word_list_fill(self);
+	if (!word_list)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&self->word_list, &expected, word_list, 0,
+	                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(word_list);
+		return expected;
+	}
+
+	return word_list;
+}
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Only aligned memory can be backed by huge pages.
+ */
+static void *idx_alloc(size_t size, unsigned int flags)
+{
+	void *ret;
+
+	if (!(flags & SD_OPEN_IDX_HUGEPAGE))
+		return malloc(size);
+
+	if (posix_memalign(&ret, HUGE_PAGE_SIZE, size))
+		return NULL;
+
+	return ret;
+}
+
+/*
+ * Reads the idx into memory, the file may be gzip compressed.
+ */
+static int idx_read(struct sd_dict *dict, const char *idx_gz_path, const char *idx_path,
+                    unsigned int flags, const char **opened_path)
+{
+	gzFile idx;
+
+	dict->idx = idx_alloc(dict->idx_filesize, flags);
+	dict->idx_mem = DICT_MEM_HEAP;
+
+	if (!dict->idx) {
+		sd_err("Failed to allocate idx");
+		return 1;
+	}
+
+	/* Before the buffer is written so that it's faulted in huge pages */
+	idx_advise(dict, flags);
+
+	*opened_path = idx_gz_path;
+	idx = gzopen(idx_gz_path, "rb");
+	if (!idx) {
+		*opened_path = idx_path;
+		idx = gzopen(idx_path, "rb");
+	}
+
+	if (!idx) {
+		sd_err("Failed to open idx");
+		return 1;
+	}
+
+	if (gzread(idx, dict->idx, dict->idx_filesize) != (int)dict->idx_filesize) {
+		sd_err("Failed to read index");
+		gzclose(idx);
+		return 1;
+	}
+
+	gzclose(idx);
+
+	return 0;
+}
+
+/*
+ * Only a plain idx file can be mapped, a compressed one is read into memory
+ * regardless of the options. The compressed idx is preferred when both exist
+ * for all residencies, so that the same file is loaded either way.
+ */
+static int idx_load(struct sd_dict *dict, const char *idx_gz_path, const char *idx_path,
+                    const struct sd_open_opts *opts, const char **opened_path)
+{
+	struct stat st;
+	int fd, ret;
+
+	if (opts->idx_mem == SD_IDX_HEAP || !access(idx_gz_path, F_OK))
+		return idx_read(dict, idx_gz_path, idx_path, opts->flags, opened_path);
+
+	fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return idx_read(dict, idx_gz_path, idx_path, opts->flags, opened_path);
+
+	*opened_path = idx_path;
+
+	if (fstat(fd, &st)) {
+		sd_err("Failed to stat '%s': %s", idx_path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	ret = idx_map(fd, st.st_size, dict, opts->idx_mem, opts->flags);
+
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * The options that are not applied in open are set by the setters.
+ */
+static int apply_opts(struct sd_dict *dict, const struct sd_open_opts *opts)
+{
+	if (opts->flags & SD_OPEN_DICT_RANDOM) {
+		if (!dict->dict_dz)
+			return 1;
+
+		dict_dz_advise_random(dict->dict_dz);
+	}
+
+	if (opts->chunk_cache && sd_set_chunk_cache(dict, opts->chunk_cache))
+		return 1;
+
+	if ((opts->flags & SD_OPEN_MMAP) && sd_set_mmap(dict, 1))
+		return 1;
+
+	if (opts->shm_cache && sd_set_shm_cache(dict, opts->shm_cache))
+		return 1;
+
+	if (opts->entry_cache && sd_set_entry_cache(dict, opts->entry_cache))
+		return 1;
+
+	if (opts->filter && sd_set_filter(dict, opts->filter))
+		return 1;
+
+	return 0;
+}
+
+struct sd_dict *sd_open_dict_opts(const char *path, const char *name,
+                                  const struct sd_open_opts *opts)
+{
+	SD_TRACE_BEGIN(open, NULL, 0);
+	static const struct sd_open_opts default_opts = {};
+	char *idx_gz_path = sd_aprintf("%s/%s.idx.gz", path, name);
+	char *idx_path = sd_aprintf("%s/%s.idx", path, name);
+	char *dict_path = sd_aprintf("%s/%s.dict.dz", path, name);
+	char *syn_path = sd_aprintf("%s/%s.syn", path, name);
+	struct sd_dict *dict = calloc(1, sizeof(struct sd_dict));
+	struct stat idx_st, syn_st = {};
+	const char *opened_path;
+
+	if (!opts)
+		opts = &default_opts;
+
+	if (!idx_gz_path || !idx_path || !dict_path || !syn_path || !dict) {
+		sd_err("Failed to allocate dict");
+		goto err;
+	}
+
+	if (parse_ifo(path, name, dict))
+		goto err;
+
+	if (idx_load(dict, idx_gz_path, idx_path, opts, &opened_path))
+		goto err;
+
+	if (!(opts->flags & SD_OPEN_LAZY_INDEX) && fill_word_list(dict))
+		goto err;
+
+	parse_syn(syn_path, dict);
+
+	if (!stat(opened_path, &idx_st) && (!stat(syn_path, &syn_st) || errno == ENOENT))
+		dict->files_id = files_id(&idx_st, &syn_st);
+
+	dict->dict_dz = parse_dict_dz(dict_path, dict);
+
+	if (apply_opts(dict, opts))
+		goto err;
+
+	free(syn_path);
+	free(dict_path);
+	free(idx_path);
+	free(idx_gz_path);
+
+	SD_TRACE_END(open, SD_TRACE_OPEN, dict, dict->word_count);
+
+	return dict;
+err:
+	free(syn_path);
+	free(idx_path);
+	free(idx_gz_path);
+	free(dict_path);
+	sd_close_dict(dict);
+	return NULL;
+}
+
+struct sd_dict *sd_open_dict(const char *path, const char *name)
+{
+	return sd_open_dict_opts(path, name, NULL);
+}
+
+struct sd_dict *sd_open_dict_fd(int ifo_fd, int idx_fd, int dict_fd, int syn_fd)
+{
+	SD_TRACE_BEGIN(open, NULL, 0);
+	struct sd_dict *dict = calloc(1, sizeof(struct sd_dict));
+	struct stat idx_st, syn_st = {};
+
+	if (!dict) {
+		sd_err("Failed to allocate dict");
+		return NULL;
+	}
+
+	if (parse_ifo_fd(ifo_fd, dict) || idx_load_fd(idx_fd, dict) || fill_word_list(dict))
+		goto err;
+
+	if (syn_fd >= 0)
+		syn_load_fd(syn_fd, dict);
+	else
+		dict->syn_count = 0;
+
+	if (!fstat(idx_fd, &idx_st) && (syn_fd < 0 || !fstat(syn_fd, &syn_st)))
+		dict->files_id = files_id(&idx_st, &syn_st);
+
+	dict->dict_dz = parse_dict_dz_fd(fcntl(dict_fd, F_DUPFD_CLOEXEC, 0), dict);
+	if (!dict->dict_dz)
+		goto err;
+
+	SD_TRACE_END(open, SD_TRACE_OPEN, dict, dict->word_count);
+
+	return dict;
+err:
+	sd_close_dict(dict);
+	return NULL;
+}
+
+struct sd_dict *sd_open_dict_mem(const struct sd_dict_mem *mem)
+{
+	SD_TRACE_BEGIN(open, NULL, 0);
+	struct sd_dict *dict = calloc(1, sizeof(struct sd_dict));
+
+	if (!dict) {
+		sd_err("Failed to allocate dict");
+		return NULL;
+	}
+
+	if (parse_ifo_buf(mem->ifo, mem->ifo_size, dict) ||
+	    idx_load_mem(mem->idx, mem->idx_size, dict) ||
+	    fill_word_list(dict))
+		goto err;
+
+	if (mem->syn)
+		syn_load(dict, (void *)mem->syn, mem->syn_size, DICT_MEM_BORROWED);
+	else
+		dict->syn_count = 0;
+
+	dict->dict_dz = parse_dict_dz_mem(mem->dict_dz, mem->dict_dz_size, dict);
+	if (!dict->dict_dz)
+		goto err;
+
+	SD_TRACE_END(open, SD_TRACE_OPEN, dict, dict->word_count);
+
+	return dict;
+err:
+	sd_close_dict(dict);
+	return NULL;
+}
+
+static unsigned int binary_lookup(char **list, unsigned int cnt, const char *prefix, int left)
+{
+	unsigned int l = 0;
+	unsigned int r = cnt - 1;
+	size_t prefix_len = strlen(prefix);
+
+	for (;;) {
+		unsigned int mid = (r + l) / 2;
+
+		int ret = strncasecmp(prefix, list[mid], prefix_len);
+		if (!ret) {
+			if (left)
+				r = mid;
+			else
+				l = mid;
+		} else {
+			if (ret < 0)
+				r = mid;
+			else
+				l = mid;
+		}
+
+		if ((l - r) <= 1 || (r - l) <= 1) {
+			int l_ret = strncasecmp(prefix, list[l], prefix_len);
+			int r_ret = strncasecmp(prefix, list[r], prefix_len);
+
+			if (l_ret && r_ret)
+				return (unsigned int)-1;
+
+			if (l_ret)
+				return r;
+
+			return l;
+		}
+	}
+}
+
+static unsigned int traced_binary_lookup(struct sd_dict *self, char **list, unsigned int cnt,
+                                         const char *prefix, int left)
+{
+	SD_TRACE_BEGIN(idx_search, self, left);
+
+	unsigned int ret = binary_lookup(list, cnt, prefix, left);
+
+	SD_TRACE_END(idx_search, SD_TRACE_IDX_SEARCH, self, ret);
+
+	return ret;
+}
+
+static unsigned int lookup_range(struct sd_dict *self, char **list, unsigned int cnt,
+                                 const char *prefix, struct sd_lookup_res *res)
+{
+	res->min = traced_binary_lookup(self, list, cnt, prefix, 1);
+
+	if (res->min == (unsigned int)-1)
+		return 0;
+
+	res->max = traced_binary_lookup(self, list, cnt, prefix, 0);
+
+	return sd_lookup_res_cnt(res);
+}
+
+static int filter_rejects(struct sd_dict *self, const char *prefix)
+{
+	if (!self->filter || sd_filter_may_match(self->filter, prefix))
+		return 0;
+
+	SD_STAT_ADD(self, filter_rejects, 1);
+
+	return 1;
+}
+
+unsigned int sd_lookup(struct sd_dict *self, const char *prefix, struct sd_lookup_res *res)
+{
+	SD_TRACE_BEGIN(lookup, self, 0);
+	char **word_list = get_word_list(self);
+	unsigned int ret;
+
+	SD_STAT_ADD(self, lookups, 1);
+
+	if (!word_list || filter_rejects(self, prefix))
+		ret = 0;
+	else
+		ret = lookup_range(self, word_list, self->word_count, prefix, res);
+
+	SD_TRACE_END(lookup, SD_TRACE_LOOKUP, self, ret);
+	return ret;
+}
+
+unsigned int sd_lookup_syn(struct sd_dict *self, const char *prefix, struct sd_lookup_res *res)
+{
+	SD_TRACE_BEGIN(lookup, self, 0);
+	unsigned int ret = 0;
+
+	if (self->syn_count && !filter_rejects(self, prefix))
+		ret = lookup_range(self, self->syn_list, self->syn_count, prefix, res);
+
+	SD_TRACE_END(lookup, SD_TRACE_LOOKUP, self, ret);
+	return ret;
+}
+
+/* The order the idx and syn files are sorted in */
+static int dict_cmp(const char *a, const char *b)
+{
+	int ret = strcasecmp(a, b);
+
+	return ret ? ret : strcmp(a, b);
+}
+
+static int idx_cmp(const void *a, const void *b)
+{
+	unsigned int ia = *(const unsigned int *)a;
+	unsigned int ib = *(const unsigned int *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+static unsigned int lookup_merged(struct sd_dict *self, char **word_list, const char *prefix,
+                                  unsigned int **idxs, unsigned int *best)
+{
+	struct sd_lookup_res words, syns;
+	unsigned int word_cnt = 0, syn_cnt = 0, w, w_end, s, s_end, i, cnt = 0;
+	unsigned int *res;
+
+	if (word_list && self->word_count)
+		word_cnt = lookup_range(self, word_list, self->word_count, prefix, &words);
+
+	if (self->syn_count)
+		syn_cnt = lookup_range(self, self->syn_list, self->syn_count, prefix, &syns);
+
+	if (!word_cnt && !syn_cnt)
+		return 0;
+
+	res = malloc((word_cnt + syn_cnt) * sizeof(*res));
+	if (!res) {
+		sd_err("Failed to allocate lookup result");
+		return 0;
+	}
+
+	if (best) {
+		if (syn_cnt && (!word_cnt ||
+		    dict_cmp(self->syn_list[syns.min], word_list[words.min]) < 0))
+			*best = syn_word_idx(self->syn_list[syns.min]);
+		else
+			*best = words.min;
+	}
+
+	/*
+	 * The synonyms are sorted by the synonym strings, we sort their word
+	 * indexes at the end of the array and merge them with the word range
+	 * from the start, the merge never overwrites unmerged synonyms.
+	 */
+	s = word_cnt;
+	s_end = word_cnt + syn_cnt;
+
+	for (i = 0; i < syn_cnt; i++)
+		res[s + i] = syn_word_idx(self->syn_list[syns.min + i]);
+
+	qsort(res + s, syn_cnt, sizeof(*res), idx_cmp);
+
+	w = word_cnt ? words.min : 0;
+	w_end = word_cnt ? words.max + 1 : 0;
+
+	while (w < w_end || s < s_end) {
+		unsigned int idx;
+
+		if (s >= s_end || (w < w_end && w <= res[s]))
+			idx = w++;
+		else
+			idx = res[s++];
+
+		if (!cnt || res[cnt - 1] != idx)
+			res[cnt++] = idx;
+	}
+
+	*idxs = res;
+
+	return cnt;
+}
+
+unsigned int sd_lookup_merged(struct sd_dict *self, const char *prefix,
+                              unsigned int **idxs, unsigned int *best)
+{
+	SD_TRACE_BEGIN(lookup, self, 0);
+	char **word_list = get_word_list(self);
+	unsigned int ret = 0;
+
+	*idxs = NULL;
+
+	SD_STAT_ADD(self, lookups, 1);
+
+	if (!filter_rejects(self, prefix))
+		ret = lookup_merged(self, word_list, prefix, idxs, best);
+
+	SD_TRACE_END(lookup, SD_TRACE_LOOKUP, self, ret);
+	return ret;
+}
+
+int sd_search(struct sd_dict *self, const char *pattern, unsigned int flags,
+              unsigned int limit, unsigned int threads, sd_search_cb cb, void *priv)
+{
+	char **word_list = get_word_list(self);
+	unsigned int first = 0, cnt = self->word_count;
+	struct sd_lookup_res res;
+	struct sd_pattern *pat;
+	const char *prefix;
+	int ret;
+
+	if (!word_list)
+		return -1;
+
+	pat = sd_pattern_compile(pattern, flags);
+	if (!pat)
+		return -1;
+
+	prefix = sd_pattern_prefix(pat);
+
+	/* Only words that start with the literal prefix can match */
+	if (prefix[0] && filter_rejects(self, prefix)) {
+		cnt = 0;
+	} else if (prefix[0]) {
+		cnt = lookup_range(self, word_list, self->word_count, prefix, &res);
+		first = res.min;
+	}
+
+	ret = cnt ? sd_search_words(pat, word_list, first, cnt, limit, threads, cb, priv) : 0;
+
+	sd_pattern_free(pat);
+
+	return ret;
+}
+
+const char *sd_syn_to_word(struct sd_dict *self, unsigned int syn_idx)
+{
+	if (syn_idx >= self->syn_count)
+		return NULL;
+
+	return self->syn_list[syn_idx];
+}
+
+unsigned int sd_syn_to_idx(struct sd_dict *self, unsigned int syn_idx)
+{
+	if (syn_idx >= self->syn_count)
+		return (unsigned int)-1;
+
+	return syn_word_idx(self->syn_list[syn_idx]);
+}
+
+const char *sd_idx_to_word(struct sd_dict *self, unsigned int idx)
+{
+	char **word_list = get_word_list(self);
+
+	if (idx >= self->word_count || !word_list)
+		return NULL;
+
+	return word_list[idx];
+}
+
+static int entry_pos(struct sd_dict *self, unsigned int idx,
+                     uint32_t *data_offset, uint32_t *data_size)
+{
+	char **word_list = get_word_list(self);
+
+	if (idx >= self->word_count || !self->dict_dz || !word_list)
+		return 1;
+
+	size_t off = strlen(word_list[idx]) + 1;
+
+	uint8_t *bytes = (uint8_t*)word_list[idx] + off;
+
+	*data_offset = bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+	*data_size = bytes[4] << 24 | bytes[5] << 16 | bytes[6] << 8 | bytes[7];
+
+	return 0;
+}
+
+/*
+ * Strips an entry in place, returns the new data size.
+ */
+static size_t strip_entry(struct sd_entry *entry, size_t size)
+{
+	switch (entry->fmt) {
+	case SD_ENTRY_PANGO_MARKUP:
+	case SD_ENTRY_HTML:
+	case SD_ENTRY_XDXF:
+		return sd_strip_markup(entry->data, size);
+	}
+
+	return size;
+}
+
+static struct sd_entry *get_entry(struct sd_dict *self, unsigned int idx, int strip)
+{
+	uint32_t data_offset, data_size;
+	struct sd_entry *res;
+	size_t size;
+
+	SD_TRACE_BEGIN(get_entry, self, idx);
+
+	if (self->entry_cache) {
+		res = sd_entry_cache_get(self->entry_cache, idx, strip);
+		if (res) {
+			SD_STAT_ADD(self, entry_cache_hits, 1);
+			goto done;
+		}
+
+		SD_STAT_ADD(self, entry_cache_misses, 1);
+	}
+
+	if (entry_pos(self, idx, &data_offset, &data_size))
+		return NULL;
+
+	res = malloc(sizeof(struct sd_entry) + data_size + 1);
+	if (!res)
+		return NULL;
+
+	res->fmt = self->entry_fmt;
+
+	if (dict_gz_read(self->dict_dz, res->data, data_offset, data_size)) {
+		free(res);
+		return NULL;
+	}
+
+	res->data[data_size] = 0;
+	size = data_size;
 
-	if (!dict->idx_filesize) {
-		sd_err("Missing idxfilesize in ifo file");
-		goto err1;
-	}
+	if (strip)
+		size = strip_entry(res, size);
 
-	if (!dict->entry_fmt) {
-		sd_err("Unsupported file wihout sametypesequence");
-		goto err1;
-	}
+	if (self->entry_cache)
+		sd_entry_cache_put(self->entry_cache, idx, strip, res, size);
+done:
+	SD_STAT_ADD(self, entries, 1);
 
-	if (!dict->book_name[0]) {
-		sd_err("Missing bookname in ifo file");
-		goto err1;
-	}
+	SD_TRACE_END(get_entry, SD_TRACE_GET_ENTRY, self, idx);
 
-	ret = 0;
-err1:
-	fclose(ifo);
-err0:
-	free(ifo_path);
-	return ret;
+	return res;
 }
 
-struct sd_dict *sd_open_dict(const char *path, const char *name)
+struct sd_entry *sd_get_entry(struct sd_dict *self, unsigned int idx)
 {
-	gzFile idx;
-	char *idx_gz_path = sd_aprintf("%s/%s.idx.gz", path, name);
-	char *idx_path = sd_aprintf("%s/%s.idx", path, name);
-	char *dict_path = sd_aprintf("%s/%s.dict.dz", path, name);
-	struct sd_dict *dict = malloc(sizeof(struct sd_dict));
-	unsigned int i;
-	void *p;
-
-	if (!idx_gz_path || !idx_path || !dict_path || !dict) {
-		sd_err("Failed to allocate dict");
-		goto err0;
-	}
+	return get_entry(self, idx, 0);
+}
 
-	memset(dict, 0, sizeof(*dict));
+struct sd_entry *sd_get_stripped_entry(struct sd_dict *self, unsigned int idx)
+{
+	return get_entry(self, idx, 1);
+}
 
-	if (parse_ifo(path, name, dict))
-		goto err0;
+int sd_set_entry_cache(struct sd_dict *self, size_t budget)
+{
+	sd_entry_cache_free(self->entry_cache);
+	self->entry_cache = NULL;
 
-	dict->word_list = malloc(dict->word_count * sizeof(char *));
-	dict->idx = malloc(dict->idx_filesize);
+	if (!budget)
+		return 0;
 
-	if (!dict->word_list || !dict->idx) {
-		sd_err("Failed to allocate idx or word_list");
-		goto err0;
-	}
+	self->entry_cache = sd_entry_cache_new(budget);
 
-	idx = gzopen(idx_gz_path, "rb");
-	if (!idx)
-		idx = gzopen(idx_path, "rb");
+	return !self->entry_cache;
+}
 
-	if (!idx) {
-		sd_err("Failed to open idx");
-		goto err0;
-	}
+/*
+ * The first and the last chunk may be shared with neighbouring entries and
+ * are read through the chunk cache, the chunks in between belong to the entry
+ * only and are inflated directly into the buffer without polluting the cache.
+ */
+int sd_stream_entry(struct sd_dict *self, unsigned int idx, sd_stream_cb cb, void *priv)
+{
+	uint32_t data_offset, data_size, chunk_off, size, i;
+	uint32_t first_chunk;
+	uint64_t last_chunk;
+	struct dict_dz_reader reader = {};
+	struct dict_dz *dz;
+	const void *in;
+	char *buf;
+	int ret;
+
+	SD_TRACE_BEGIN(get_entry, self, idx);
+
+	if (entry_pos(self, idx, &data_offset, &data_size))
+		return 1;
 
-	if (gzread(idx, dict->idx, dict->idx_filesize) != (int)dict->idx_filesize) {
-		sd_err("Failed to read index");
-		goto err1;
-	}
+	if (!data_size)
+		goto done;
 
-	gzclose(idx);
+	dz = self->dict_dz;
+	if (!dz)
+		return 1;
 
-	p = dict->idx;
+	first_chunk = data_offset / dz->chunk_decomp_size;
+	last_chunk = ((uint64_t)data_offset + data_size - 1) / dz->chunk_decomp_size;
 
-	for (i = 0; i < dict->word_count; i++) {
-		dict->word_list[i] = p;
-		p += strlen(p) + 1 + 8;
+	if (last_chunk >= dz->chunk_cnt || first_chunk > last_chunk) {
+		sd_err("[offset, offset + size] out of data");
+		return 1;
 	}
 
-	dict->dict_dz = parse_dict_dz(dict_path);
-
-	free(dict_path);
-	free(idx_path);
-	free(idx_gz_path);
+	if (last_chunk - first_chunk > 1 &&
+	    dict_dz_reader_init(&reader, dz, dz->chunks[first_chunk + 1].offset,
+	                   dz->chunks[last_chunk].offset))
+		return 1;
 
-	return dict;
-err1:
-	free(dict->word_list);
-	free(dict->idx);
-err0:
-	free(idx_path);
-	free(idx_gz_path);
-	free(dict_path);
-	free(dict);
-	return NULL;
-}
+	buf = malloc(dz->chunk_decomp_size);
+	if (!buf) {
+		sd_err("Failed to allocate chunk buffer");
+		dict_dz_reader_free(&reader);
+		return 1;
+	}
 
-static unsigned int binary_lookup(struct sd_dict *self, const char *prefix, int left)
-{
-	unsigned int l = 0;
-	unsigned int r = self->word_count - 1;
-	size_t prefix_len = strlen(prefix);
+	chunk_off = data_offset - first_chunk * dz->chunk_decomp_size;
 
-	for (;;) {
-		unsigned int mid = (r + l) / 2;
+	for (i = first_chunk; i <= last_chunk; i++) {
+		size = MIN(data_size, dz->chunk_decomp_size - chunk_off);
 
-		int ret = strncasecmp(prefix, self->word_list[mid], prefix_len);
-		if (!ret) {
-			if (left)
-				r = mid;
-			else
-				l = mid;
+		if (i == first_chunk || i == last_chunk) {
+			ret = dict_gz_copy_chunk(dz, i, buf, chunk_off, size);
 		} else {
-			if (ret < 0)
-				r = mid;
-			else
-				l = mid;
+			in = dict_dz_reader_chunk(&reader, i);
+			ret = !in || dict_gz_inflate(dz, i, in, buf);
 		}
 
-		if ((l - r) <= 1 || (r - l) <= 1) {
-			int l_ret = strncasecmp(prefix, self->word_list[l], prefix_len);
-			int r_ret = strncasecmp(prefix, self->word_list[r], prefix_len);
-
-			if (l_ret && r_ret)
-				return (unsigned int)-1;
+		if (ret)
+			goto exit;
 
-			if (l_ret)
-				return r;
+		ret = cb(buf, size, priv);
+		if (ret)
+			goto exit;
 
-			return l;
-		}
+		data_size -= size;
+		chunk_off = 0;
 	}
-}
-
-unsigned int sd_lookup(struct sd_dict *self, const char *prefix, struct sd_lookup_res *res)
-{
-	res->min = binary_lookup(self, prefix, 1);
 
-	if (res->min == (unsigned int)-1)
-		return 0;
+	free(buf);
+	dict_dz_reader_free(&reader);
+done:
+	SD_STAT_ADD(self, entries, 1);
 
-	res->max = binary_lookup(self, prefix, 0);
+	SD_TRACE_END(get_entry, SD_TRACE_GET_ENTRY, self, idx);
 
-	return sd_lookup_res_cnt(res);
+	return 0;
+exit:
+	free(buf);
+	dict_dz_reader_free(&reader);
+	return ret;
 }
 
-const char *sd_idx_to_word(struct sd_dict *self, unsigned int idx)
+struct foreach_pos {
+	uint32_t offset;
+	uint32_t size;
+	unsigned int idx;
+};
+
+static int foreach_pos_cmp(const void *a, const void *b)
 {
-	if (idx >= self->word_count)
-		return NULL;
+	const struct foreach_pos *pa = a;
+	const struct foreach_pos *pb = b;
+
+	if (pa->offset != pb->offset)
+		return pa->offset < pb->offset ? -1 : 1;
 
-	return self->word_list[idx];
+	if (pa->size != pb->size)
+		return pa->size < pb->size ? -1 : 1;
+
+	if (pa->idx != pb->idx)
+		return pa->idx < pb->idx ? -1 : 1;
+
+	return 0;
 }
 
-struct sd_entry *sd_get_entry(struct sd_dict *self, unsigned int idx)
+/*
+ * Decompressed chunks [first, first + cnt) stored back to back so that entries
+ * spanning several chunks are contiguous in memory.
+ */
+struct foreach_window {
+	char *buf;
+	uint32_t first;
+	uint32_t cnt;
+	uint32_t size;
+};
+
+static int foreach_window_fill(struct foreach_window *self, struct dict_dz_reader *reader,
+                               uint32_t first, uint32_t last)
 {
-	if (idx >= self->word_count)
-		return NULL;
+	struct dict_dz *dz = reader->dz;
+	size_t chunk_size = dz->chunk_decomp_size;
+	uint32_t drop;
 
-	size_t off = strlen(self->word_list[idx]) + 1;
+	/* Entries are sorted by offset, chunks before the first are done */
+	if (first > self->first) {
+		drop = MIN(first - self->first, self->cnt);
 
-	uint8_t *bytes = (uint8_t*)self->word_list[idx] + off;
+		memmove(self->buf, self->buf + drop * chunk_size,
+		        (self->cnt - drop) * chunk_size);
 
-	uint32_t data_offset = bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
-	uint32_t data_size = bytes[4] << 24 | bytes[5] << 16 | bytes[6] << 8 | bytes[7];
+		self->cnt -= drop;
+		self->first = self->cnt ? self->first + drop : first;
+	}
 
-	struct sd_entry *res = malloc(sizeof(struct sd_entry) + data_size + 1);
-	if (!res)
-		return NULL;
+	if (last - self->first + 1 > self->size) {
+		uint32_t size = last - self->first + 1;
+		char *buf = realloc(self->buf, size * chunk_size + 1);
 
-	res->fmt = self->entry_fmt;
+		if (!buf) {
+			sd_err("Failed to allocate chunk window");
+			return 1;
+		}
 
-	if (dict_gz_read(self->dict_dz, res->data, data_offset, data_size)) {
-		free(res);
-		return NULL;
+		self->buf = buf;
+		self->size = size;
 	}
 
-	res->data[data_size] = 0;
+	while (self->first + self->cnt <= last) {
+		uint16_t idx = self->first + self->cnt;
+		const void *in = dict_dz_reader_chunk(reader, idx);
 
-	return res;
+		if (!in || dict_gz_inflate(dz, idx, in, self->buf + self->cnt * chunk_size))
+			return 1;
+
+		self->cnt++;
+	}
+
+	return 0;
 }
 
-static void strip_tags(struct sd_entry *entry)
+/*
+ * Visits the entries in the order they are stored in the dict.dz file, each
+ * chunk is inflated exactly once and the chunk cache is not used at all.
+ */
+int sd_foreach_entry(struct sd_dict *self, sd_foreach_cb cb, void *priv)
 {
-	char *i, *c;
-	int copy = 1;
-	int br = 0;
+	struct foreach_window window = {};
+	struct dict_dz_reader reader = {};
+	struct foreach_pos *pos;
+	struct dict_dz *dz = self->dict_dz;
+	char **word_list = get_word_list(self);
+	unsigned int i;
+	int ret = 1;
 
-	for (c = i = entry->data; *i; i++) {
-		/* Newlines in HTML */
-		if (!copy) {
-			switch (br) {
-			case 1:
-				if (*i == 'b' || *i == 'B')
-					br++;
-				else
-					br = 0;
-			break;
-			case 2:
-				if (*i == 'r' || *i == 'R')
-					br++;
-				else
-					br = 0;
-			break;
-			case 3:
-				if (*i == ' ' || *i == '>')
-					*(c++) = '\n';
-				br = 0;
-			break;
-			}
-		}
+	if (!dz || !word_list)
+		return 1;
+
+	/* Without any chunks only empty entries are valid */
+	if (dz->chunk_cnt && dict_dz_reader_init(&reader, dz, dz->chunks[0].offset,
+	                                         dict_gz_chunk_end(dz, dz->chunk_cnt - 1)))
+		return 1;
+
+	pos = malloc(sizeof(*pos) * self->word_count);
+	if (!pos) {
+		sd_err("Failed to allocate entry positions");
+		goto exit;
+	}
+
+	for (i = 0; i < self->word_count; i++) {
+		pos[i].idx = i;
+		entry_pos(self, i, &pos[i].offset, &pos[i].size);
+	}
+
+	qsort(pos, self->word_count, sizeof(*pos), foreach_pos_cmp);
+
+	for (i = 0; i < self->word_count; i++) {
+		uint32_t first, last;
+		char *data, save;
+
+		if (!pos[i].size) {
+			ret = cb(pos[i].idx, word_list[pos[i].idx], "", 0, priv);
+			if (ret)
+				goto exit;
 
-		if (*i == '<') {
-			copy = 0;
-			br = 1;
+			SD_STAT_ADD(self, entries, 1);
 			continue;
 		}
 
-		if (*i == '>') {
-			copy = 1;
-			continue;
+		first = pos[i].offset / dz->chunk_decomp_size;
+		last = ((uint64_t)pos[i].offset + pos[i].size - 1) / dz->chunk_decomp_size;
+
+		if (last >= dz->chunk_cnt) {
+			sd_err("[offset, offset + size] out of data");
+			ret = 1;
+			goto exit;
+		}
+
+		if (foreach_window_fill(&window, &reader, first, last)) {
+			ret = 1;
+			goto exit;
 		}
 
-		if (copy)
-			*(c++) = *i;
+		data = window.buf + (pos[i].offset - (uint64_t)window.first * dz->chunk_decomp_size);
+
+		/* Null terminate the entry, the byte belongs to the next one */
+		save = data[pos[i].size];
+		data[pos[i].size] = 0;
+
+		ret = cb(pos[i].idx, word_list[pos[i].idx], data, pos[i].size, priv);
+
+		data[pos[i].size] = save;
+
+		if (ret)
+			goto exit;
+
+		SD_STAT_ADD(self, entries, 1);
 	}
 
-	*c = 0;
+	ret = 0;
+exit:
+	free(window.buf);
+	dict_dz_reader_free(&reader);
+	free(pos);
+	return ret;
 }
 
-int sd_strip_entry(struct sd_entry *entry)
+static size_t dict_dz_mem(struct dict_dz *self, size_t *mem_cache)
 {
-	switch (entry->fmt) {
-	case SD_ENTRY_UTF8_TEXT:
-		return 1;
-	case SD_ENTRY_PANGO_MARKUP:
-	case SD_ENTRY_HTML:
-        case SD_ENTRY_XDXF:
-		strip_tags(entry);
-		return 1;
+	uint16_t i;
+
+	*mem_cache = 0;
+
+	if (!self)
+		return 0;
+
+	for (i = 0; i < self->cache_slots; i++) {
+		if (self->chunk_cache[i].data)
+			*mem_cache += self->chunk_decomp_size;
 	}
 
-	return 0;
+	*mem_cache += self->cache_slots * sizeof(struct cached_chunk);
+
+	return sizeof(struct dict_dz) + (sizeof(struct chunk_pos) + sizeof(uint16_t)) * self->chunk_cnt;
 }
 
-void sd_free_entry(struct sd_entry *entry)
+void sd_get_stats(struct sd_dict *self, struct sd_stats *stats)
 {
-	free(entry);
+	/* The counters are updated concurrently, each one is read atomically */
+	stats->lookups = SD_STAT_GET(self, lookups);
+	stats->entries = SD_STAT_GET(self, entries);
+	stats->cache_hits = SD_STAT_GET(self, cache_hits);
+	stats->cache_misses = SD_STAT_GET(self, cache_misses);
+	stats->cache_evictions = SD_STAT_GET(self, cache_evictions);
+	stats->shm_hits = SD_STAT_GET(self, shm_hits);
+	stats->shm_misses = SD_STAT_GET(self, shm_misses);
+	stats->entry_cache_hits = SD_STAT_GET(self, entry_cache_hits);
+	stats->entry_cache_misses = SD_STAT_GET(self, entry_cache_misses);
+	stats->filter_rejects = SD_STAT_GET(self, filter_rejects);
+	stats->bytes_compressed = SD_STAT_GET(self, bytes_compressed);
+	stats->bytes_decompressed = SD_STAT_GET(self, bytes_decompressed);
+	stats->read_calls = SD_STAT_GET(self, read_calls);
+
+	/* Mapped and borrowed index is not allocated by the library */
+	stats->mem_idx = self->idx_mem == DICT_MEM_HEAP ? self->idx_filesize : 0;
+	stats->mem_word_list = sizeof(char *) * self->syn_count;
+	if (self->word_list)
+		stats->mem_word_list += sizeof(char *) * self->word_count;
+	stats->mem_total = sizeof(struct sd_dict) + stats->mem_idx + stats->mem_word_list;
+	stats->mem_total += dict_dz_mem(self->dict_dz, &stats->mem_cache);
+	stats->mem_total += stats->mem_cache;
+	stats->mem_entry_cache = sd_entry_cache_mem(self->entry_cache);
+	stats->mem_total += stats->mem_entry_cache;
+	stats->mem_filter = sd_filter_mem(self->filter);
+	stats->mem_total += stats->mem_filter;
 }
 
-void sd_close_dict(struct sd_dict *dict)
+void sd_reset_stats(struct sd_dict *self)
 {
-	if (!dict)
-		return;
-
-	destroy_dict_dz(dict->dict_dz);
-	free(dict->word_list);
-	free(dict->idx);
-	free(dict);
+	SD_STAT_SET(self, lookups, 0);
+	SD_STAT_SET(self, entries, 0);
+	SD_STAT_SET(self, cache_hits, 0);
+	SD_STAT_SET(self, cache_misses, 0);
+	SD_STAT_SET(self, cache_evictions, 0);
+	SD_STAT_SET(self, shm_hits, 0);
+	SD_STAT_SET(self, shm_misses, 0);
+	SD_STAT_SET(self, entry_cache_hits, 0);
+	SD_STAT_SET(self, entry_cache_misses, 0);
+	SD_STAT_SET(self, filter_rejects, 0);
+	SD_STAT_SET(self, bytes_compressed, 0);
+	SD_STAT_SET(self, bytes_decompressed, 0);
+	SD_STAT_SET(self, read_calls, 0);
 }
 
-#define SD_DICT_DIR "/usr/share/stardict/dic"
-#define SD_DICT_USER_DIR ".stardict/dic"
-
-static int parse_bookname(const char *path, const char *fname, char *book_name)
+int sd_set_mmap(struct sd_dict *self, int enable)
 {
-	char *ifo_path = sd_aprintf("%s/%s", path, fname);
-	FILE *ifo;
-	char line[128];
-	int ret = 0;
+	struct dict_dz *dz = self->dict_dz;
+	size_t size;
+	void *map;
 
-	if (!ifo_path) {
-		ret = 1;
-		goto err0;
+	if (!dz)
+		return 1;
+
+	/* In memory dictionary, the buffer is used as it is */
+	if (dz->fd < 0)
+		return 0;
+
+	if (!enable) {
+		if (dz->map)
+			munmap((void *)dz->map, dz->map_size);
+
+		dz->map = NULL;
+		return 0;
 	}
 
-	ifo = fopen(ifo_path, "r");
-	if (!ifo) {
-		sd_err("Failed to open '%s': %s", ifo_path, strerror(errno));
-		ret = 1;
-		goto err1;
+	if (dz->map || !dz->chunk_cnt)
+		return 0;
+
+	size = dict_gz_chunk_end(dz, dz->chunk_cnt - 1);
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, dz->fd, 0);
+	if (map == MAP_FAILED) {
+		sd_err("Failed to map dict.dz file: %s", strerror(errno));
+		return 1;
 	}
 
-	while (fgets(line, sizeof(line), ifo))
-		sscanf(line, "bookname=%63[^\n]s\n", book_name);
+	dz->map = map;
+	dz->map_size = size;
 
-	ret = book_name[0] == 0;
+	if (dz->advice_random)
+		madvise(map, size, MADV_RANDOM);
 
-	if (ret)
-		sd_err("Invalid ifo file '%s'", fname);
+	return 0;
+}
 
-	fclose(ifo);
-err1:
-	free(ifo_path);
-err0:
-	return ret;
+int sd_set_chunk_cache(struct sd_dict *self, size_t budget)
+{
+	struct dict_dz *dz = self->dict_dz;
+	size_t slots = CHUNK_CACHE_SIZE;
+
+	if (!dz)
+		return 1;
+
+	if (budget)
+		slots = budget / MAX(1u, dz->chunk_decomp_size);
+
+	return dict_dz_chunk_cache_resize(dz, slots);
 }
 
-static void dir_lookup(const char *dir_path, unsigned int *cnt,
-                       struct sd_dict_path *dest[])
+static char *filter_cache_path(struct sd_dict *self)
 {
-	struct dirent *entry;
-	DIR *dir = opendir(dir_path);
+	char *name, *ret;
 
-	if (!dir)
-		return;
+	if (!self->files_id)
+		return NULL;
 
-	while ((entry = readdir(dir))) {
-		size_t len = strlen(entry->d_name);
+	name = sd_aprintf("filter-%s", self->files_id);
+	if (!name)
+		return NULL;
 
-		if (len < 4)
-			continue;
+	ret = sd_cache_file(name);
 
-		if (!strcmp(entry->d_name + len - 4, ".ifo")) {
-			if (dest) {
-				struct sd_dict_path *path = malloc(sizeof(struct sd_dict_path) + len - 3);
+	free(name);
 
-				if (!path)
-					continue;
+	return ret;
+}
 
-				memset(path, 0, sizeof(*path));
+int sd_set_filter(struct sd_dict *self, unsigned int flags)
+{
+	char *cache_path = NULL;
 
-				if (parse_bookname(dir_path, entry->d_name, path->book_name)) {
-					free(path);
-					continue;
-				}
+	sd_filter_free(self->filter);
+	self->filter = NULL;
 
-				memcpy(path->fname, entry->d_name, len - 4);
-				path->fname[len - 4] = 0;
+	if (!flags)
+		return 0;
 
-				path->dir = dir_path;
+	if (flags & SD_FILTER_CACHE) {
+		cache_path = filter_cache_path(self);
+		if (cache_path)
+			self->filter = sd_filter_load(cache_path);
+	}
 
-				dest[*cnt] = path;
-			}
+	if (!self->filter && get_word_list(self)) {
+		self->filter = sd_filter_build(self);
 
-			(*cnt)++;
-		}
+		/* Failure to write the cache is not fatal */
+		if (self->filter && cache_path && !sd_cache_mkdir())
+			sd_filter_store(self->filter, cache_path);
 	}
 
-	closedir(dir);
+	free(cache_path);
+
+	return !self->filter;
 }
 
-void sd_lookup_dict_paths(struct sd_dict_paths *paths)
+int sd_set_shm_cache(struct sd_dict *self, unsigned int slots)
 {
-	char *home = getenv("HOME");
+	struct dict_dz *dz = self->dict_dz;
 
-	paths->dict_cnt = 0;
-	paths->home_sd_dir = sd_aprintf("%s/%s", home, SD_DICT_USER_DIR);
-	paths->paths = NULL;
+	if (!dz)
+		return 1;
 
-	if (paths->home_sd_dir)
-		dir_lookup(paths->home_sd_dir, &paths->dict_cnt, NULL);
+	if (dz->fd < 0) {
+		sd_err("Shared chunk cache needs a dictionary file");
+		return 1;
+	}
 
-	dir_lookup(SD_DICT_DIR, &paths->dict_cnt, NULL);
+	sd_shm_cache_close(dz->shm_cache);
+	dz->shm_cache = NULL;
 
-	if (!paths->dict_cnt)
-		return;
+	if (!slots)
+		return 0;
 
-	paths->paths = malloc(sizeof(struct sd_dict_path*) * paths->dict_cnt);
+	dz->shm_cache = sd_shm_cache_open(dz->fd, dz->chunk_decomp_size, slots);
 
-	paths->dict_cnt = 0;
+	return !dz->shm_cache;
+}
 
-	if (!paths->paths) {
-		free(paths->home_sd_dir);
-		return;
+int sd_strip_entry(struct sd_entry *entry)
+{
+	switch (entry->fmt) {
+	case SD_ENTRY_UTF8_TEXT:
+		return 1;
+	case SD_ENTRY_PANGO_MARKUP:
+	case SD_ENTRY_HTML:
+        case SD_ENTRY_XDXF:
+		sd_strip_markup(entry->data, strlen(entry->data));
+		return 1;
 	}
 
-	if (paths->home_sd_dir) {
-		dir_lookup(paths->home_sd_dir, &paths->dict_cnt, paths->paths);
-		if (!paths->dict_cnt) {
-			free(paths->home_sd_dir);
-			paths->home_sd_dir = NULL;
-		}
-	}
+	return 0;
+}
 
-	dir_lookup(SD_DICT_DIR, &paths->dict_cnt, paths->paths);
+void sd_free_entry(struct sd_entry *entry)
+{
+	free(entry);
 }
 
-void sd_free_dict_paths(struct sd_dict_paths *paths)
+void sd_close_dict(struct sd_dict *dict)
 {
-	unsigned int i;
+	if (!dict)
+		return;
 
-	free(paths->home_sd_dir);
+	destroy_dict_dz(dict->dict_dz);
+	sd_entry_cache_free(dict->entry_cache);
+	sd_filter_free(dict->filter);
+	free(dict->files_id);
 
-	for (i = 0; i < paths->dict_cnt; i++)
-		free(paths->paths[i]);
+	dict_mem_release(dict->syn, dict->syn_size, dict->syn_mem);
+	dict_mem_release(dict->idx, dict->idx_filesize, dict->idx_mem);
 
-	free(paths->paths);
+	free(dict->syn_list);
+	free(dict->hist);
+	free(dict->word_list);
+	free(dict);
 }
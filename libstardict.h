@@ -9,6 +9,7 @@
 #define LIBSTARDICT_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 struct dict_dz;
 
@@ -27,6 +28,66 @@ enum sd_entry_fmt {
 
 #define SD_DICT_BOOKNAME_MAX 64
 
+/**
+ * Dictionary runtime statistics.
+ *
+ * The counters are updated on each call, the memory usage is computed when
+ * the snapshot is taken by sd_get_stats().
+ */
+struct sd_stats {
+	/* number of sd_lookup() calls */
+	uint64_t lookups;
+	/* number of entries returned by sd_get_entry() */
+	uint64_t entries;
+
+	/* dict.dz chunk cache hits, misses and evicted chunks */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+
+	/* shared chunk cache hits and misses, see sd_set_shm_cache() */
+	uint64_t shm_hits;
+	uint64_t shm_misses;
+
+	/* decoded entry cache hits and misses, see sd_set_entry_cache() */
+	uint64_t entry_cache_hits;
+	uint64_t entry_cache_misses;
+
+	/* lookups rejected by the prefix filter, see sd_set_filter() */
+	uint64_t filter_rejects;
+
+	/* bytes read from dict.dz and bytes inflated */
+	uint64_t bytes_compressed;
+	uint64_t bytes_decompressed;
+	/* read syscalls on dict.dz */
+	uint64_t read_calls;
+
+	/* heap memory used by index, word lookup table and chunk cache in bytes */
+	size_t mem_idx;
+	size_t mem_word_list;
+	size_t mem_cache;
+	/* memory used by the decoded entry cache in bytes */
+	size_t mem_entry_cache;
+	/* memory used by the prefix filter in bytes */
+	size_t mem_filter;
+	/* all memory including the above */
+	size_t mem_total;
+};
+
+/**
+ * Latency histogram with power of two buckets.
+ *
+ * The buckets[i] counts durations in [2^i, 2^(i+1)) nanoseconds.
+ */
+#define SD_HIST_BUCKETS 64
+
+struct sd_hist {
+	uint64_t cnt;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[SD_HIST_BUCKETS];
+};
+
 struct sd_dict {
 	/* set if sametypesequence= is set in the ifo file */
 	char entry_fmt;
@@ -45,9 +106,38 @@ struct sd_dict {
 	 */
 	struct dict_dz *dict_dz;
 
-	/* dictionary index and word list lookup array */
+	/*
+	 * Dictionary index and word list lookup array, the word list is NULL
+	 * until the first lookup with SD_OPEN_LAZY_INDEX.
+	 */
 	void *idx;
 	char **word_list;
+
+	/* runtime statistics, use sd_get_stats() to read them */
+	struct sd_stats stats;
+
+	/* latency histograms, allocated when enabled, use sd_get_hist() */
+	struct sd_hist *hist;
+
+	/* decoded entry cache, DO NOT TOUCH use sd_set_entry_cache() */
+	struct sd_entry_cache *entry_cache;
+
+	/* number of synonyms in the syn file, zero if there is none */
+	unsigned int syn_count;
+
+	/* mapped syn file and synonym lookup array */
+	void *syn;
+	size_t syn_size;
+	char **syn_list;
+
+	/* how idx and syn memory is held, DO NOT TOUCH */
+	uint8_t idx_mem;
+	uint8_t syn_mem;
+
+	/* prefix filter, DO NOT TOUCH use sd_set_filter() */
+	struct sd_filter *filter;
+	/* idx and syn file identity, names per dictionary cache files */
+	char *files_id;
 };
 
 /**
@@ -60,6 +150,108 @@ struct sd_dict {
  */
 struct sd_dict *sd_open_dict(const char *path, const char *name);
 
+/**
+ * Where the idx file is held in memory.
+ */
+enum sd_idx_mem {
+	/* read into an allocated buffer, the default */
+	SD_IDX_HEAP,
+	/* mapped, pages are read on the first access and may be evicted */
+	SD_IDX_MMAP,
+	/* mapped and read in advance with MAP_POPULATE */
+	SD_IDX_MMAP_POPULATE,
+	/* mapped, read in advance and locked in memory with mlock() */
+	SD_IDX_MMAP_LOCK,
+};
+
+enum sd_open_flags {
+	/* build the word list on the first lookup rather than in open */
+	SD_OPEN_LAZY_INDEX = 0x01,
+	/* map the dict.dz file, see sd_set_mmap() */
+	SD_OPEN_MMAP = 0x02,
+	/* advise the kernel that the dict.dz data are read randomly */
+	SD_OPEN_DICT_RANDOM = 0x04,
+	/* advise the kernel to read the mapped idx in advance */
+	SD_OPEN_IDX_WILLNEED = 0x08,
+	/* advise the kernel to back the idx with huge pages */
+	SD_OPEN_IDX_HUGEPAGE = 0x10,
+};
+
+/**
+ * Dictionary open options, zero initialized options are the defaults used by
+ * sd_open_dict().
+ */
+struct sd_open_opts {
+	/* enum sd_idx_mem */
+	unsigned int idx_mem;
+	/* bitmask of enum sd_open_flags */
+	unsigned int flags;
+	/* chunk cache budget in bytes, zero for the default, see sd_set_chunk_cache() */
+	size_t chunk_cache;
+	/* decoded entry cache budget in bytes, see sd_set_entry_cache() */
+	size_t entry_cache;
+	/* shared chunk cache slots, see sd_set_shm_cache() */
+	unsigned int shm_cache;
+	/* bitmask of enum sd_filter_flags, see sd_set_filter() */
+	unsigned int filter;
+};
+
+/**
+ * @brief Opens a stardict format dictionary with options.
+ *
+ * @path Path to a dictionary directory.
+ * @name A dictionary name.
+ * @opts Open options, NULL for the defaults.
+ *
+ * @return A dictionary or NULL in a case of a failure, including a failure
+ *         to apply any of the options.
+ */
+struct sd_dict *sd_open_dict_opts(const char *path, const char *name,
+                                  const struct sd_open_opts *opts);
+
+/**
+ * @brief Opens a stardict format dictionary from file descriptors.
+ *
+ * The files are read with pread() so the file offsets are not changed and
+ * the caller keeps the ownership of the descriptors, the dict.dz descriptor
+ * is duplicated. Plain idx and syn files are mapped rather than copied.
+ *
+ * @ifo_fd An ifo file descriptor.
+ * @idx_fd An idx file descriptor, the file may be gzip compressed.
+ * @dict_fd A dict.dz file descriptor.
+ * @syn_fd A syn file descriptor or -1 if there is none.
+ *
+ * @return A dictionary or NULL in a case of a failure.
+ */
+struct sd_dict *sd_open_dict_fd(int ifo_fd, int idx_fd, int dict_fd, int syn_fd);
+
+/**
+ * Dictionary files in memory, the syn file is optional.
+ */
+struct sd_dict_mem {
+	const void *ifo;
+	size_t ifo_size;
+	const void *idx;
+	size_t idx_size;
+	const void *dict_dz;
+	size_t dict_dz_size;
+	const void *syn;
+	size_t syn_size;
+};
+
+/**
+ * @brief Opens a stardict format dictionary from memory buffers.
+ *
+ * The buffers are used in place and must stay valid until the dictionary is
+ * closed, only a gzip compressed idx is inflated into a newly allocated
+ * buffer.
+ *
+ * @mem Dictionary file buffers.
+ *
+ * @return A dictionary or NULL in a case of a failure.
+ */
+struct sd_dict *sd_open_dict_mem(const struct sd_dict_mem *mem);
+
 /**
  * @brief Closes a dictionary.
  *
@@ -95,6 +287,101 @@ static inline unsigned int sd_lookup_res_cnt(struct sd_lookup_res *res)
 	return res->max - res->min + 1;
 }
 
+/**
+ * @brief Looks up a range in the sorted synonym table.
+ *
+ * Synonyms are alternate spellings or inflected forms of the words in the
+ * index, each synonym maps to an index, see sd_syn_to_idx().
+ *
+ * @self A dictionary.
+ * @prefix An utf8 string prefix to look for.
+ * @res A range in the synonym table to store the result into.
+ *
+ * @return Returns a number of synonyms in the result range, when zero is
+ *         returned the range is res is not valid.
+ */
+unsigned int sd_lookup_syn(struct sd_dict *self, const char *prefix, struct sd_lookup_res *res);
+
+/**
+ * @brief Looks up a prefix in both the index and the synonym table.
+ *
+ * The matching words and the words the matching synonyms belong to are merged
+ * into a single list of word indexes without duplicates sorted in the index
+ * order.
+ *
+ * @self A dictionary.
+ * @prefix An utf8 string prefix to look for.
+ * @idxs Set to an array of word indexes, the array has to be freed by the
+ *       caller, set to NULL when nothing was found.
+ * @best Set to the index of the best match, i.e. the word or the synonym that
+ *       comes first in the dictionary order, may be NULL.
+ *
+ * @return Returns a number of word indexes in the array, zero if nothing was
+ *         found or on an allocation failure.
+ */
+unsigned int sd_lookup_merged(struct sd_dict *self, const char *prefix,
+                              unsigned int **idxs, unsigned int *best);
+
+enum sd_search_flags {
+	/* the pattern is a regular expression rather than a glob */
+	SD_SEARCH_REGEX = 0x01,
+};
+
+/**
+ * @brief A callback for sd_search().
+ *
+ * @idx An index of a matching word.
+ * @word The matching word.
+ * @priv A pointer passed to sd_search().
+ *
+ * @return Zero to continue, non-zero stops the search.
+ */
+typedef int (*sd_search_cb)(unsigned int idx, const char *word, void *priv);
+
+/**
+ * @brief Searches headwords matching a glob or a regular expression.
+ *
+ * Globs support *, ? and [] classes and match whole words. Regular
+ * expressions support ^ and $ anchors, ., [] classes and *, + and ?
+ * quantifiers, groups and alternations are not supported. Matching time is
+ * linear in the word length for any pattern. ASCII letters are compared case
+ * insensitively.
+ *
+ * Patterns with a literal prefix search only the range of words with the
+ * prefix, other patterns scan the whole index in parallel. The matches are
+ * reported in the index order from the calling thread.
+ *
+ * @self A dictionary.
+ * @pattern A pattern.
+ * @flags A bitmask of enum sd_search_flags.
+ * @limit A maximal number of reported matches, zero for unlimited.
+ * @threads A number of threads, zero for the number of CPUs.
+ * @cb A callback called for each match.
+ * @priv A pointer passed to the callback.
+ *
+ * @return A number of reported matches or -1 on invalid pattern or a failure.
+ */
+int sd_search(struct sd_dict *self, const char *pattern, unsigned int flags,
+              unsigned int limit, unsigned int threads, sd_search_cb cb, void *priv);
+
+/**
+ * @brief Returns a synonym string for a given synonym index.
+ *
+ * @dict A dictionary
+ * @syn_idx An index into the synonym table
+ * @return A string or NULL if index is out of bounds.
+ */
+const char *sd_syn_to_word(struct sd_dict *dict, unsigned int syn_idx);
+
+/**
+ * @brief Returns an index of the word a synonym belongs to.
+ *
+ * @dict A dictionary
+ * @syn_idx An index into the synonym table
+ * @return An index into the word lookup table or -1 if index is out of bounds.
+ */
+unsigned int sd_syn_to_idx(struct sd_dict *dict, unsigned int syn_idx);
+
 /**
  * @brief Returns a string for a given index
  *
@@ -114,6 +401,8 @@ struct sd_entry {
 /**
  * @brief Loads an entry at index.
  *
+ * May be called from multiple threads for the same dictionary.
+ *
  * @dict A dictionary.
  * @idx An entry index.
  *
@@ -121,6 +410,98 @@ struct sd_entry {
  */
 struct sd_entry *sd_get_entry(struct sd_dict *dict, unsigned int idx);
 
+/**
+ * @brief Loads an entry at index with text formatting stripped.
+ *
+ * Same as sd_get_entry() followed by sd_strip_entry(), but the stripped
+ * entry is cached when the entry cache is enabled.
+ *
+ * May be called from multiple threads for the same dictionary.
+ *
+ * @dict A dictionary.
+ * @idx An entry index.
+ *
+ * @return Newly allocated entry or NULL on a failure.
+ */
+struct sd_entry *sd_get_stripped_entry(struct sd_dict *dict, unsigned int idx);
+
+/**
+ * @brief Enables LRU cache of decoded entries.
+ *
+ * Entries returned by sd_get_entry() and sd_get_stripped_entry() are kept in
+ * the cache until the memory budget is exhausted, repeated requests for an
+ * entry are then served by a copy from the cache without any decompression.
+ * Must not be called concurrently with entry reads.
+ *
+ * @dict A dictionary.
+ * @budget A memory budget in bytes, zero disables and frees the cache.
+ *
+ * @return Zero on success, non-zero on a failure.
+ */
+int sd_set_entry_cache(struct sd_dict *dict, size_t budget);
+
+/**
+ * @brief A callback for sd_stream_entry().
+ *
+ * @data Next part of the entry data, valid only during the call.
+ * @size Size of the data.
+ * @priv A pointer passed to sd_stream_entry().
+ *
+ * @return Zero to continue, non-zero stops the streaming.
+ */
+typedef int (*sd_stream_cb)(const char *data, size_t size, void *priv);
+
+/**
+ * @brief Streams an entry data chunk by chunk.
+ *
+ * The memory usage is bounded by a single decompressed chunk and a read
+ * buffer regardless of the entry size.
+ *
+ * May be called from multiple threads for the same dictionary.
+ *
+ * @dict A dictionary.
+ * @idx An entry index.
+ * @cb A callback called for each part of the entry data.
+ * @priv A pointer passed to the callback.
+ *
+ * @return Zero on success, non-zero value returned by the callback or one on
+ *         a failure.
+ */
+int sd_stream_entry(struct sd_dict *dict, unsigned int idx, sd_stream_cb cb, void *priv);
+
+/**
+ * @brief A callback for sd_foreach_entry().
+ *
+ * @idx An entry index.
+ * @word A headword for the entry.
+ * @data Null terminated entry data, valid only during the call.
+ * @size Size of the data.
+ * @priv A pointer passed to sd_foreach_entry().
+ *
+ * @return Zero to continue, non-zero stops the iteration.
+ */
+typedef int (*sd_foreach_cb)(unsigned int idx, const char *word,
+                             const char *data, size_t size, void *priv);
+
+/**
+ * @brief Calls a callback for each entry in a dictionary.
+ *
+ * The entries are visited in the order of the data in the dictionary file
+ * rather than in the index order, which makes it possible to decompress each
+ * chunk exactly once. Entries that share the same data are visited one after
+ * another. Meant for exporting or repacking whole dictionaries.
+ *
+ * May be called from multiple threads for the same dictionary.
+ *
+ * @dict A dictionary.
+ * @cb A callback called for each entry.
+ * @priv A pointer passed to the callback.
+ *
+ * @return Zero on success, non-zero value returned by the callback or one on
+ *         a failure.
+ */
+int sd_foreach_entry(struct sd_dict *dict, sd_foreach_cb cb, void *priv);
+
 /**
  * @brief If possible strip text formatting from entry data.
  *
@@ -129,6 +510,13 @@ struct sd_entry *sd_get_entry(struct sd_dict *dict, unsigned int idx);
  */
 int sd_strip_entry(struct sd_entry *entry);
 
+/**
+ * @brief Returns the instruction set used by sd_strip_entry().
+ *
+ * @return One of "avx2", "sse2" or "scalar".
+ */
+const char *sd_strip_impl(void);
+
 /**
  * @brief Frees an entry.
  *
@@ -136,6 +524,165 @@ int sd_strip_entry(struct sd_entry *entry);
  */
 void sd_free_entry(struct sd_entry *entry);
 
+/**
+ * @brief Returns a snapshot of dictionary statistics.
+ *
+ * @self A dictionary.
+ * @stats A structure to store the statistics into.
+ */
+void sd_get_stats(struct sd_dict *self, struct sd_stats *stats);
+
+/**
+ * @brief Resets dictionary statistics counters.
+ *
+ * @self A dictionary.
+ */
+void sd_reset_stats(struct sd_dict *self);
+
+/**
+ * @brief Maps the compressed dictionary file into memory.
+ *
+ * Chunk cache misses are then served from the page cache without read
+ * syscalls. Must not be called concurrently with entry reads.
+ *
+ * @self A dictionary.
+ * @enable Non-zero maps the file, zero unmaps it.
+ *
+ * @return Zero on success, non-zero on a failure.
+ */
+int sd_set_mmap(struct sd_dict *self, int enable);
+
+/**
+ * @brief Sets the decompressed chunk cache budget.
+ *
+ * The cache holds at least one and at most all chunks of the dict.dz file,
+ * the cached chunks are kept as long as they fit into the new size, the
+ * recently used ones first. Must not be called concurrently with entry reads.
+ *
+ * @self A dictionary.
+ * @budget A budget in bytes, zero restores the default size.
+ *
+ * @return Zero on success, non-zero on a failure.
+ */
+int sd_set_chunk_cache(struct sd_dict *self, size_t budget);
+
+/**
+ * @brief Attaches a decompressed chunk cache shared between processes.
+ *
+ * All processes that open the same dictionary file and enable the cache share
+ * a single shared memory segment, chunks inflated by one process are then
+ * read by all of them. The segment is created with the given number of
+ * slots by the first process, later processes use its size. Must not be
+ * called concurrently with entry reads.
+ *
+ * @self A dictionary.
+ * @slots A number of chunk slots, zero detaches the cache.
+ *
+ * @return Zero on success, non-zero on a failure.
+ */
+int sd_set_shm_cache(struct sd_dict *self, unsigned int slots);
+
+enum sd_filter_flags {
+	/* build a prefix filter from the word lists */
+	SD_FILTER_BUILD = 0x01,
+	/* load the filter from and store it into ~/.cache/libstardict/ */
+	SD_FILTER_CACHE = 0x02,
+};
+
+/**
+ * @brief Enables a prefix filter that rejects lookups that cannot match.
+ *
+ * The filter is a Bloom filter of case folded headword and synonym prefixes
+ * that lets sd_lookup() and sd_lookup_syn() return zero without searching the
+ * index, which speeds up queries over many dictionaries where most of them do
+ * not contain the word. It costs about 1.5 bytes per distinct prefix. Must
+ * not be called concurrently with lookups.
+ *
+ * @self A dictionary.
+ * @flags A bitmask of enum sd_filter_flags, zero frees the filter.
+ *
+ * @return Zero on success, non-zero on a failure.
+ */
+int sd_set_filter(struct sd_dict *self, unsigned int flags);
+
+/**
+ * Trace points on the hot paths.
+ */
+enum sd_trace_point {
+	/* whole sd_open_dict(), arg is word count, the histogram is global */
+	SD_TRACE_OPEN,
+	/* whole sd_lookup(), arg is number of results */
+	SD_TRACE_LOOKUP,
+	/* whole sd_get_entry(), arg is the entry index */
+	SD_TRACE_GET_ENTRY,
+	/* single binary search in the index, arg is the result */
+	SD_TRACE_IDX_SEARCH,
+	/* read of a compressed chunk, arg is the chunk index */
+	SD_TRACE_PREAD,
+	/* chunk decompression, arg is the chunk index */
+	SD_TRACE_INFLATE,
+	/* copy from a decompressed chunk, arg is number of bytes */
+	SD_TRACE_MEMCPY,
+	SD_TRACE_CNT,
+};
+
+enum sd_trace_flags {
+	/* record per dictionary latency histograms */
+	SD_TRACE_HIST = 0x01,
+	/* call the trace callback */
+	SD_TRACE_CB = 0x02,
+};
+
+typedef void (*sd_trace_cb)(struct sd_dict *dict, enum sd_trace_point point,
+                            uint64_t duration_ns, uint64_t arg, void *priv);
+
+/**
+ * @brief Enables latency instrumentation.
+ *
+ * The setting is global for all dictionaries. The instrumentation is
+ * disabled by default and costs a single branch per trace point then.
+ *
+ * @flags A bitmask of enum sd_trace_flags, zero disables tracing.
+ * @cb A callback called on each trace point if SD_TRACE_CB is set.
+ * @priv A pointer passed to the callback.
+ */
+void sd_set_trace(unsigned int flags, sd_trace_cb cb, void *priv);
+
+/**
+ * @brief Returns a copy of a latency histogram.
+ *
+ * The SD_TRACE_OPEN histogram is shared by all dictionaries.
+ *
+ * @self A dictionary, may be NULL for SD_TRACE_OPEN.
+ * @point A trace point.
+ * @hist A histogram to store the data into.
+ *
+ * @return Zero on success, non-zero if no data were recorded.
+ */
+int sd_get_hist(struct sd_dict *self, enum sd_trace_point point, struct sd_hist *hist);
+
+/**
+ * @brief Resets dictionary latency histograms.
+ *
+ * @self A dictionary, NULL resets the global SD_TRACE_OPEN histogram.
+ */
+void sd_reset_hist(struct sd_dict *self);
+
+/**
+ * @brief Returns an upper bound for a percentile in a histogram.
+ *
+ * @hist A histogram.
+ * @percentile A percentile e.g. 99.9
+ *
+ * @return A duration in nanoseconds.
+ */
+uint64_t sd_hist_percentile(const struct sd_hist *hist, double percentile);
+
+/**
+ * @brief Returns a trace point name.
+ */
+const char *sd_trace_point_name(enum sd_trace_point point);
+
 struct sd_dict_path {
 	const char *dir;
 	char book_name[SD_DICT_BOOKNAME_MAX];
@@ -155,6 +702,25 @@ struct sd_dict_paths {
  */
 void sd_lookup_dict_paths(struct sd_dict_paths *paths);
 
+enum sd_scan_flags {
+	/* parse ifo files in parallel */
+	SD_SCAN_PARALLEL = 0x01,
+	/* use and update persistent manifest in ~/.cache/libstardict/ */
+	SD_SCAN_CACHE = 0x02,
+};
+
+/**
+ * @brief Scans system for stardict dictionaries.
+ *
+ * With SD_SCAN_CACHE directories whose mtime and whose ifo files mtime and
+ * size did not change since the last scan are enumerated from the manifest
+ * without opening any ifo file.
+ *
+ * @paths A strucutre to fill the scanned directories into.
+ * @flags A bitmask of enum sd_scan_flags.
+ */
+void sd_scan_dict_paths(struct sd_dict_paths *paths, unsigned int flags);
+
 /**
  * @brief Frees stardict dictionary paths.
  *
@@ -162,4 +728,128 @@ void sd_lookup_dict_paths(struct sd_dict_paths *paths);
  */
 void sd_free_dict_paths(struct sd_dict_paths *paths);
 
+struct sd_dict_watch;
+
+enum sd_dict_event {
+	SD_DICT_ADDED,
+	SD_DICT_REMOVED,
+};
+
+/**
+ * @brief A dictionary change callback.
+ *
+ * The path is freed right after the callback returns for SD_DICT_REMOVED.
+ */
+typedef void (*sd_dict_watch_cb)(enum sd_dict_event ev,
+                                 const struct sd_dict_path *path, void *priv);
+
+/**
+ * @brief Starts watching dictionary directories for changes.
+ *
+ * The paths must be filled in by the lookup and must not be freed before the
+ * watch is.
+ *
+ * @paths Dictionary paths to be kept in sync with the directories content.
+ *
+ * @return A watch or NULL on a failure.
+ */
+struct sd_dict_watch *sd_dict_watch_new(struct sd_dict_paths *paths);
+
+/**
+ * @brief Returns a file descriptor to poll() for changes.
+ */
+int sd_dict_watch_fd(struct sd_dict_watch *self);
+
+/**
+ * @brief Processes pending changes, does not block.
+ *
+ * Updates the paths and calls the callback for each added or removed
+ * dictionary.
+ *
+ * @return A number of processed events or -1 on a failure.
+ */
+int sd_dict_watch_process(struct sd_dict_watch *self, sd_dict_watch_cb cb, void *priv);
+
+/**
+ * @brief Stops watching and frees the watch.
+ */
+void sd_dict_watch_free(struct sd_dict_watch *self);
+
+struct sd_writer;
+
+/**
+ * @brief Starts writing a new stardict dictionary.
+ *
+ * The entries are compressed into the dict.dz file as they are added, the
+ * index is sorted and written along with the ifo file in sd_writer_close().
+ *
+ * @path A directory to write the dictionary files into.
+ * @name A dictionary filename without a suffix.
+ * @book_name A dictionary name.
+ * @entry_fmt An sd_entry_fmt of the entries.
+ *
+ * @return A writer or NULL in a case of a failure.
+ */
+struct sd_writer *sd_writer_open(const char *path, const char *name,
+                                 const char *book_name, char entry_fmt);
+
+/**
+ * @brief Sets dictzip chunk size.
+ *
+ * Smaller chunks mean less data to inflate on a chunk cache miss at the cost
+ * of slightly worse compression ratio. Has to be called before first entry
+ * is added.
+ *
+ * @self A writer.
+ * @chunk_size An uncompressed chunk size, at most 58315 bytes.
+ *
+ * @return Zero on success, non-zero if the size is not valid.
+ */
+int sd_writer_set_chunk_size(struct sd_writer *self, unsigned int chunk_size);
+
+/**
+ * @brief Enables gzip compression for the index file.
+ *
+ * @self A writer.
+ * @gzip_idx If non-zero idx.gz is written instead of idx.
+ */
+void sd_writer_set_gzip_idx(struct sd_writer *self, int gzip_idx);
+
+/**
+ * @brief Adds an entry into the dictionary.
+ *
+ * Entries can be added in any order.
+ *
+ * @self A writer.
+ * @word An utf8 headword shorter than 256 bytes.
+ * @data An entry data.
+ * @data_size An entry data size.
+ *
+ * @return Zero on success, non-zero on a failure. Once an error happened all
+ *         subsequent calls fail and nothing is written on close.
+ */
+int sd_writer_add(struct sd_writer *self, const char *word,
+                  const void *data, uint32_t data_size);
+
+/**
+ * @brief Adds a headword that shares the data of the last added entry.
+ *
+ * The data are stored only once and both index entries point to them.
+ *
+ * @self A writer.
+ * @word An utf8 headword shorter than 256 bytes.
+ *
+ * @return Zero on success, non-zero on a failure or if no entry was added yet.
+ */
+int sd_writer_add_alias(struct sd_writer *self, const char *word);
+
+/**
+ * @brief Writes the dictionary files and frees the writer.
+ *
+ * @self A writer.
+ *
+ * @return Zero on success, non-zero on a failure.
+ */
+int sd_writer_close(struct sd_writer *self);
+
 #endif /* LIBSTARDICT_H__ */
@@ -66,6 +66,7 @@ DESTDIR="$RPM_BUILD_ROOT" make install
 %files -n sd-cmd
 %defattr(-,root,root)
 %{_bindir}/sd-cmd
+%{_bindir}/sd-pack
 
 %changelog
 * Sun Jan 29 2023 Cyril Hrubis <metan@ucw.cz>
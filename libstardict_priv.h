@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Library internal definitions shared between the library source files.
+ *
+ * This header is not installed.
+ */
+
+#ifndef LIBSTARDICT_PRIV_H__
+#define LIBSTARDICT_PRIV_H__
+
+#include "sd_util.h"
+
+#define SD_HIDDEN __attribute__ ((visibility ("hidden")))
+
+__attribute__ ((format (printf, 1, 2)))
+SD_HIDDEN char *sd_aprintf(const char *fmt, ...);
+
+__attribute__ ((format (printf, 1, 2)))
+SD_HIDDEN void sd_err(const char *fmt, ...);
+
+#define GZ_MAGIC1 0x1f
+#define GZ_MAGIC2 0x8b
+
+#define GZ_METHOD_DEFLATE 0x08
+
+#define GZ_FLAGS_CRC 0x02
+#define GZ_FLAGS_EXTRA_FIELD 0x04
+#define GZ_FLAGS_FNAME 0x08
+#define GZ_FLAGS_COMMENT 0x10
+
+#define GZ_OS_UNIX 0x03
+
+#define DICT_DZ_MAGIC1 'R'
+#define DICT_DZ_MAGIC2 'A'
+
+#define DICT_DZ_VERSION 1
+
+/*
+ * Maximal dictzip chunk size, compressed chunk sizes are stored in 16 bits
+ * and this leaves enough space for incompressible data.
+ */
+#define DICT_DZ_CHUNK_MAX 58315
+
+#define GZIP_HEADER_SIZE 10
+#define EXTRA_HEADER_SIZE 12
+#define HEADER_SIZE (GZIP_HEADER_SIZE + EXTRA_HEADER_SIZE)
+
+#define IFO_MAGIC "StarDict's dict ifo file\n"
+
+/*
+ * Counters updated from threads that call sd_get_entry() concurrently.
+ */
+#define SD_STAT_ADD(dict, counter, val) \
+	__atomic_fetch_add(&(dict)->stats.counter, val, __ATOMIC_RELAXED)
+
+#define SD_STAT_GET(dict, counter) \
+	__atomic_load_n(&(dict)->stats.counter, __ATOMIC_RELAXED)
+
+#define SD_STAT_SET(dict, counter, val) \
+	__atomic_store_n(&(dict)->stats.counter, val, __ATOMIC_RELAXED)
+
+/*
+ * Dictionary discovery helpers.
+ */
+#define SD_DICT_DIR "/usr/share/stardict/dic"
+#define SD_DICT_USER_DIR ".stardict/dic"
+
+SD_HIDDEN int sd_parse_bookname(const char *path, const char *fname, char *book_name);
+
+SD_HIDDEN struct sd_dict_path *sd_new_dict_path(const char *dir, const char *fname, size_t len);
+
+SD_HIDDEN int sd_dict_paths_append(struct sd_dict_paths *paths, unsigned int *size,
+                                   struct sd_dict_path *path);
+
+/*
+ * Converts markup to plain text in place, returns the new string length. The
+ * size is the string length, the string is null terminated at str[size].
+ */
+SD_HIDDEN size_t sd_strip_markup(char *str, size_t size);
+
+/*
+ * Returns a path to a file in the per user cache directory.
+ */
+SD_HIDDEN char *sd_cache_file(const char *name);
+
+/*
+ * Creates the per user cache directory.
+ */
+SD_HIDDEN int sd_cache_mkdir(void);
+
+/*
+ * Decompressed chunk cache shared between processes, see sd_shm_cache.c.
+ */
+struct sd_shm_cache;
+
+/*
+ * The fd is the dict.dz file, it has to stay open until the cache is closed.
+ */
+SD_HIDDEN struct sd_shm_cache *sd_shm_cache_open(int fd, uint32_t chunk_size, unsigned int slots);
+
+SD_HIDDEN int sd_shm_cache_has(struct sd_shm_cache *self, uint32_t idx);
+
+/*
+ * Copies a part of a cached chunk, returns non-zero on a miss.
+ */
+SD_HIDDEN int sd_shm_cache_copy(struct sd_shm_cache *self, uint32_t idx, void *dst,
+                                uint32_t off, uint32_t size);
+
+SD_HIDDEN void sd_shm_cache_put(struct sd_shm_cache *self, uint32_t idx, const void *data);
+
+SD_HIDDEN size_t sd_shm_cache_size(struct sd_shm_cache *self);
+
+SD_HIDDEN void sd_shm_cache_close(struct sd_shm_cache *self);
+
+/*
+ * LRU cache of decoded entries, see sd_entry_cache.c.
+ */
+struct sd_entry_cache;
+
+SD_HIDDEN struct sd_entry_cache *sd_entry_cache_new(size_t budget);
+
+/*
+ * Returns a newly allocated copy of a cached entry or NULL on a miss.
+ */
+SD_HIDDEN struct sd_entry *sd_entry_cache_get(struct sd_entry_cache *self,
+                                              unsigned int idx, int stripped);
+
+SD_HIDDEN void sd_entry_cache_put(struct sd_entry_cache *self, unsigned int idx, int stripped,
+                                  const struct sd_entry *entry, size_t size);
+
+SD_HIDDEN size_t sd_entry_cache_mem(struct sd_entry_cache *self);
+
+SD_HIDDEN void sd_entry_cache_free(struct sd_entry_cache *self);
+
+/*
+ * Prefix filter, see sd_filter.c.
+ */
+struct sd_filter;
+
+SD_HIDDEN struct sd_filter *sd_filter_build(struct sd_dict *dict);
+
+/*
+ * Returns zero if no word in the dictionary starts with the prefix.
+ */
+SD_HIDDEN int sd_filter_may_match(struct sd_filter *self, const char *prefix);
+
+SD_HIDDEN struct sd_filter *sd_filter_load(const char *path);
+
+SD_HIDDEN int sd_filter_store(struct sd_filter *self, const char *path);
+
+SD_HIDDEN size_t sd_filter_mem(struct sd_filter *self);
+
+SD_HIDDEN void sd_filter_free(struct sd_filter *self);
+
+/*
+ * Glob and regular expression search, see sd_search.c.
+ */
+struct sd_pattern;
+
+/* Longest literal prefix used to narrow down the search */
+#define SD_SEARCH_PREFIX_MAX 64
+
+SD_HIDDEN struct sd_pattern *sd_pattern_compile(const char *pattern, unsigned int flags);
+
+/*
+ * Returns literal text all matches start with, may be empty.
+ */
+SD_HIDDEN const char *sd_pattern_prefix(struct sd_pattern *self);
+
+SD_HIDDEN int sd_pattern_match(const struct sd_pattern *self, const char *word);
+
+SD_HIDDEN void sd_pattern_free(struct sd_pattern *self);
+
+/*
+ * Matches words in [first, first + cnt) in parallel and reports the matches in
+ * the index order, returns the number of reported matches or -1 on a failure.
+ */
+SD_HIDDEN int sd_search_words(const struct sd_pattern *pat, char **words, unsigned int first,
+                              unsigned int cnt, unsigned int limit, unsigned int threads,
+                              sd_search_cb cb, void *priv);
+
+/*
+ * Tracing, the timestamps are taken only if tracing is enabled by
+ * sd_set_trace(), the USDT probes are compiled in with USDT=1.
+ */
+SD_HIDDEN extern unsigned int sd_trace_flags;
+
+SD_HIDDEN uint64_t sd_now_ns(void);
+
+SD_HIDDEN void sd_trace_end(struct sd_dict *dict, enum sd_trace_point point,
+                            uint64_t start, uint64_t arg);
+
+static inline uint64_t sd_trace_begin(void)
+{
+	if (!__atomic_load_n(&sd_trace_flags, __ATOMIC_RELAXED))
+		return 0;
+
+	return sd_now_ns();
+}
+
+#ifdef SD_USDT
+# include <sys/sdt.h>
+# define SD_PROBE(name, dict, arg) DTRACE_PROBE2(libstardict, name, dict, arg)
+#else
+# define SD_PROBE(name, dict, arg) do {} while (0)
+#endif
+
+#define SD_TRACE_BEGIN(name, dict, arg) \
+	uint64_t trace_##name = sd_trace_begin(); \
+	SD_PROBE(name##_begin, dict, arg)
+
+#define SD_TRACE_END(name, point, dict, arg) do { \
+	SD_PROBE(name##_end, dict, arg); \
+	if (trace_##name) \
+		sd_trace_end(dict, point, trace_##name, arg); \
+} while (0)
+
+#endif /* LIBSTARDICT_PRIV_H__ */
@@ -1,7 +1,8 @@
 LIB=stardict
-LIB_SRCS=libstardict.c
-LIB_LDLIBS=-lz
-LIB_HEADERS=$(wildcard *.h)
+LIB_SRCS=libstardict.c sd_dict_paths.c sd_writer.c sd_trace.c sd_dict_watch.c sd_strip.c sd_shm_cache.c sd_entry_cache.c sd_filter.c sd_search.c
+LIB_LDLIBS=-lz -lpthread -lrt
+LIB_HEADERS=libstardict.h
 
-BIN_SRCS=$(BIN).c
-BIN=sd-cmd
+BIN=sd-cmd sd-pack sd-bench
+BIN_NOINST=sd-bench
+BIN_SRCS=$(addsuffix .c,$(BIN))
@@ -0,0 +1,721 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Benchmarks dictionary open, lookup, entry retrieval and markup stripping.
+ *
+ * The results are printed as a single JSON object to stdout so that they can
+ * be compared between releases.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "libstardict.h"
+
+static unsigned int lookup_iters = 100000;
+static unsigned int entry_iters = 10000;
+static unsigned int open_iters = 3;
+static unsigned int strip_iters = 200;
+static unsigned int strip_size = 256 * 1024;
+static unsigned int entry_cache_kib = 4096;
+static unsigned int synth_words = 100000;
+static unsigned int chunk_size;
+static int hist;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long proc_status_kb(const char *key)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	size_t key_len = strlen(key);
+	char line[256];
+	long ret = -1;
+
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, key, key_len) && line[key_len] == ':') {
+			ret = atol(line + key_len + 1);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t*)a;
+	uint64_t ub = *(const uint64_t*)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static void print_percentiles(const char *name, uint64_t *samples, size_t cnt, int last)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	qsort(samples, cnt, sizeof(*samples), cmp_u64);
+
+	for (i = 0; i < cnt; i++)
+		sum += samples[i];
+
+	printf("\t\t\"%s\": {\"samples\": %zu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+	       "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+	       name, cnt,
+	       (unsigned long long)(cnt ? sum / cnt : 0),
+	       (unsigned long long)(cnt ? samples[cnt * 50 / 100] : 0),
+	       (unsigned long long)(cnt ? samples[cnt * 90 / 100] : 0),
+	       (unsigned long long)(cnt ? samples[cnt * 99 / 100] : 0),
+	       (unsigned long long)(cnt ? samples[cnt * 999 / 1000] : 0),
+	       (unsigned long long)(cnt ? samples[cnt - 1] : 0),
+	       last ? "" : ",");
+}
+
+static void print_str(const char *str)
+{
+	putchar('"');
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+
+		if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+
+	putchar('"');
+}
+
+static void random_word(char *buf, unsigned int min_len, unsigned int max_len)
+{
+	unsigned int i, len = min_len + random() % (max_len - min_len + 1);
+
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + random() % 26;
+
+	buf[len] = 0;
+}
+
+/*
+ * Synthetic dictionary with random headwords and HTML entries with length
+ * roughly distributed like in a real world dictionaries.
+ */
+static int write_synth_dict(const char *path, const char *name)
+{
+	struct sd_writer *writer;
+	char word[32], *data;
+	size_t data_size = 8192;
+	unsigned int i;
+
+	data = malloc(data_size);
+	if (!data)
+		return 1;
+
+	writer = sd_writer_open(path, name, "Synthetic dictionary", SD_ENTRY_HTML);
+	if (!writer) {
+		free(data);
+		return 1;
+	}
+
+	if (chunk_size && sd_writer_set_chunk_size(writer, chunk_size)) {
+		sd_writer_close(writer);
+		free(data);
+		return 1;
+	}
+
+	for (i = 0; i < synth_words; i++) {
+		unsigned int defs = 1 + random() % 8;
+		size_t len = 0;
+
+		random_word(word, 3, 12);
+
+		len += snprintf(data + len, data_size - len, "<b>%s</b><br>", word);
+
+		while (defs--) {
+			char def[32];
+
+			random_word(def, 3, 20);
+			len += snprintf(data + len, data_size - len,
+			                "<i>n.</i> %s &amp; %s%s<br>\n", def, word, def);
+		}
+
+		if (sd_writer_add(writer, word, data, len))
+			break;
+	}
+
+	free(data);
+
+	return sd_writer_close(writer);
+}
+
+/*
+ * Writes the dictionary from a child process so that the writer memory does
+ * not show up in the peak RSS of the benchmark.
+ */
+static int gen_synth_dict(const char *path, const char *name)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return 1;
+
+	if (!pid)
+		exit(write_synth_dict(path, name));
+
+	if (waitpid(pid, &status, 0) < 0)
+		return 1;
+
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static int rm_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+	(void) sb;
+	(void) typeflag;
+	(void) ftwbuf;
+
+	return remove(fpath);
+}
+
+static struct sd_dict *bench_open(const char *path, const char *name)
+{
+	struct sd_dict *dict = NULL;
+	uint64_t samples[open_iters];
+	long rss_before, hwm = -1;
+	unsigned int i;
+
+	rss_before = proc_status_kb("VmRSS");
+
+	for (i = 0; i < open_iters; i++) {
+		uint64_t start = now_ns();
+
+		dict = sd_open_dict(path, name);
+		if (!dict)
+			return NULL;
+
+		samples[i] = now_ns() - start;
+
+		if (!i)
+			hwm = proc_status_kb("VmHWM");
+
+		if (i + 1 < open_iters)
+			sd_close_dict(dict);
+	}
+
+	printf("\t\"dict\": {\"book_name\": ");
+	print_str(dict->book_name);
+	printf(", \"word_count\": %u, \"idx_filesize\": %u},\n",
+	       dict->word_count, dict->idx_filesize);
+
+	printf("\t\"open\": {\n");
+	print_percentiles("wall", samples, open_iters, 0);
+	struct sd_stats stats;
+
+	sd_get_stats(dict, &stats);
+
+	printf("\t\t\"rss_before_kb\": %li, \"peak_rss_kb\": %li, \"rss_kb\": %li,\n",
+	       rss_before, hwm, proc_status_kb("VmRSS"));
+	printf("\t\t\"mem_idx\": %zu, \"mem_word_list\": %zu, \"mem_total\": %zu\n",
+	       stats.mem_idx, stats.mem_word_list, stats.mem_total);
+	printf("\t},\n");
+
+	return dict;
+}
+
+#define MISS_LEN_MAX 10
+
+static void bench_misses(struct sd_dict *dict, const char *name, uint64_t *samples,
+                         char (*words)[MISS_LEN_MAX + 1])
+{
+	struct sd_lookup_res res;
+	unsigned int i;
+
+	for (i = 0; i < lookup_iters; i++) {
+		uint64_t start = now_ns();
+
+		sd_lookup(dict, words[i], &res);
+		samples[i] = now_ns() - start;
+	}
+
+	print_percentiles(name, samples, lookup_iters, 0);
+}
+
+static void bench_lookup(struct sd_dict *dict)
+{
+	uint64_t *samples = malloc(sizeof(uint64_t) * lookup_iters);
+	char (*words)[MISS_LEN_MAX + 1];
+	struct sd_lookup_res res;
+	unsigned int i, cnt;
+
+	if (!samples)
+		return;
+
+	printf("\t\"lookup\": {\n");
+
+	for (i = 0; i < lookup_iters; i++) {
+		const char *word = sd_idx_to_word(dict, random() % dict->word_count);
+		uint64_t start = now_ns();
+
+		sd_lookup(dict, word, &res);
+		samples[i] = now_ns() - start;
+	}
+
+	print_percentiles("random", samples, lookup_iters, 0);
+
+	for (i = 0; i < lookup_iters; i++) {
+		const char *word = sd_idx_to_word(dict, i % dict->word_count);
+		uint64_t start = now_ns();
+
+		sd_lookup(dict, word, &res);
+		samples[i] = now_ns() - start;
+	}
+
+	print_percentiles("sequential", samples, lookup_iters, 0);
+
+	/* Random words that are mostly not in the dictionary */
+	words = malloc(sizeof(*words) * lookup_iters);
+	if (words) {
+		for (i = 0; i < lookup_iters; i++) {
+			unsigned int j, len = 3 + random() % (MISS_LEN_MAX - 2);
+
+			for (j = 0; j < len; j++)
+				words[i][j] = 'a' + random() % 26;
+
+			words[i][len] = 0;
+		}
+
+		bench_misses(dict, "miss", samples, words);
+
+		if (!sd_set_filter(dict, SD_FILTER_BUILD)) {
+			bench_misses(dict, "miss_filter", samples, words);
+			sd_set_filter(dict, 0);
+		}
+
+		free(words);
+	}
+
+	/* Prefixes of a random word as they are being typed */
+	for (cnt = 0; cnt < lookup_iters;) {
+		const char *word = sd_idx_to_word(dict, random() % dict->word_count);
+		size_t len = strlen(word);
+		char prefix[len + 1];
+
+		for (i = 1; i <= len && cnt < lookup_iters; i++) {
+			memcpy(prefix, word, i);
+			prefix[i] = 0;
+
+			uint64_t start = now_ns();
+			sd_lookup(dict, prefix, &res);
+			samples[cnt++] = now_ns() - start;
+		}
+	}
+
+	print_percentiles("typeahead", samples, lookup_iters, 1);
+
+	printf("\t},\n");
+
+	free(samples);
+}
+
+static long page_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void bench_entries(struct sd_dict *dict, const char *name,
+                          unsigned int *idxs, unsigned int idxs_cnt, int strip, int last)
+{
+	uint64_t *samples = malloc(sizeof(uint64_t) * entry_iters);
+	struct sd_stats before, after;
+	uint64_t bytes = 0, dur = 0;
+	unsigned int i;
+	long faults;
+
+	if (!samples)
+		return;
+
+	sd_get_stats(dict, &before);
+
+	faults = page_faults();
+
+	for (i = 0; i < entry_iters; i++) {
+		uint64_t start = now_ns();
+		struct sd_entry *entry;
+
+		if (strip)
+			entry = sd_get_stripped_entry(dict, idxs[i % idxs_cnt]);
+		else
+			entry = sd_get_entry(dict, idxs[i % idxs_cnt]);
+
+		samples[i] = now_ns() - start;
+		dur += samples[i];
+
+		if (entry)
+			bytes += strlen(entry->data);
+
+		sd_free_entry(entry);
+	}
+
+	faults = page_faults() - faults;
+
+	sd_get_stats(dict, &after);
+
+	qsort(samples, entry_iters, sizeof(*samples), cmp_u64);
+
+	uint64_t hits = after.cache_hits - before.cache_hits;
+	uint64_t misses = after.cache_misses - before.cache_misses;
+
+	printf("\t\t\"%s\": {\"entries\": %u, \"bytes\": %llu, \"entries_per_s\": %.0f, "
+	       "\"mb_per_s\": %.2f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+	       "\"cache_hits\": %llu, \"cache_misses\": %llu, "
+	       "\"cache_hit_rate\": %.4f, \"cache_evictions\": %llu, \"read_calls\": %llu, "
+	       "\"page_faults\": %li, \"entry_cache_hits\": %llu, "
+	       "\"bytes_compressed\": %llu, \"bytes_decompressed\": %llu}%s\n",
+	       name, entry_iters, (unsigned long long)bytes,
+	       1e9 * entry_iters / dur, 1e3 * bytes / dur,
+	       (unsigned long long)samples[entry_iters * 50 / 100],
+	       (unsigned long long)samples[entry_iters * 99 / 100],
+	       (unsigned long long)hits, (unsigned long long)misses,
+	       hits + misses ? (double)hits / (hits + misses) : 0,
+	       (unsigned long long)(after.cache_evictions - before.cache_evictions),
+	       (unsigned long long)(after.read_calls - before.read_calls), faults,
+	       (unsigned long long)(after.entry_cache_hits - before.entry_cache_hits),
+	       (unsigned long long)(after.bytes_compressed - before.bytes_compressed),
+	       (unsigned long long)(after.bytes_decompressed - before.bytes_decompressed),
+	       last ? "" : ",");
+
+	free(samples);
+}
+
+/*
+ * Roughly Zipfian distributed index, a rank is picked uniformly from a
+ * uniformly picked power of two range so that the probability of a rank r is
+ * proportional to 1/r. The ranks are scattered over the index.
+ */
+static unsigned int zipf_idx(unsigned int word_count)
+{
+	unsigned int bits = 32 - __builtin_clz(word_count);
+	unsigned int rank = random() % (1u << (random() % bits + 1));
+
+	return (rank * 2654435761u) % word_count;
+}
+
+static void bench_get_entry(struct sd_dict *dict, int last)
+{
+	unsigned int hot[2], *cold, *zipf;
+	unsigned int i;
+
+	cold = malloc(sizeof(unsigned int) * entry_iters);
+	zipf = malloc(sizeof(unsigned int) * entry_iters);
+	if (!cold || !zipf) {
+		free(cold);
+		free(zipf);
+		return;
+	}
+
+	for (i = 0; i < entry_iters; i++) {
+		cold[i] = random() % dict->word_count;
+		zipf[i] = zipf_idx(dict->word_count);
+	}
+
+	/* Working set small enough to fit into the chunk cache */
+	hot[0] = random() % dict->word_count;
+	hot[1] = random() % dict->word_count;
+
+	printf("\t\"get_entry\": {\n");
+	bench_entries(dict, "hot", hot, 2, 0, 0);
+	bench_entries(dict, "cold", cold, entry_iters, 0, 0);
+
+	/* Popular words stripped as clients request them */
+	bench_entries(dict, "zipf_stripped", zipf, entry_iters, 1, 0);
+
+	if (!sd_set_entry_cache(dict, (size_t)entry_cache_kib * 1024)) {
+		bench_entries(dict, "zipf_stripped_entry_cache", zipf, entry_iters, 1, 0);
+		sd_set_entry_cache(dict, 0);
+	}
+
+	/* Cache misses served from the mapped file without read syscalls */
+	if (sd_set_mmap(dict, 1)) {
+		printf("\t\t\"cold_mmap\": null\n");
+	} else {
+		bench_entries(dict, "cold_mmap", cold, entry_iters, 0, 1);
+		sd_set_mmap(dict, 0);
+	}
+	printf("\t}%s\n", last ? "" : ",");
+
+	free(cold);
+	free(zipf);
+}
+
+static const char *strip_markup[] = {
+	"<b>", "</b>", "<i>", "</i>", "<br>", "<p>", "</p>",
+	"<div class=\"sense\">", "</div>", "<a href=\"#ref\">", "</a>",
+	"&amp;", "&lt;", "&gt;", "&nbsp;", "&mdash;", "&#x2192;", "&#233;",
+};
+
+/*
+ * Large HTML entry with a mix of text, tags and entities.
+ */
+static char *gen_html_entry(size_t size)
+{
+	char *html = malloc(size + 1);
+	size_t len = 0;
+	char word[32];
+
+	if (!html)
+		return NULL;
+
+	while (len < size) {
+		const char *str = word;
+		size_t str_len;
+
+		if (random() % 4) {
+			random_word(word, 1, 10);
+			strcat(word, " ");
+		} else {
+			str = strip_markup[random() % (sizeof(strip_markup) / sizeof(*strip_markup))];
+		}
+
+		str_len = strlen(str);
+		if (len + str_len > size)
+			break;
+
+		memcpy(html + len, str, str_len);
+		len += str_len;
+	}
+
+	html[len] = 0;
+
+	return html;
+}
+
+static void bench_strip(int last)
+{
+	char *html = gen_html_entry(strip_size);
+	size_t len, out_len = 0;
+	struct sd_entry *entry;
+	uint64_t start, dur;
+	unsigned int i;
+
+	if (!html)
+		return;
+
+	len = strlen(html);
+
+	entry = malloc(sizeof(struct sd_entry) + len + 1);
+	if (!entry) {
+		free(html);
+		return;
+	}
+
+	start = now_ns();
+
+	for (i = 0; i < strip_iters; i++) {
+		entry->fmt = SD_ENTRY_HTML;
+		memcpy(entry->data, html, len + 1);
+		sd_strip_entry(entry);
+		out_len += strlen(entry->data);
+	}
+
+	dur = now_ns() - start;
+
+	printf("\t\"strip\": {\"impl\": \"%s\", \"entry_bytes\": %zu, \"stripped_bytes\": %zu, "
+	       "\"iters\": %u, \"ns_per_entry\": %llu, \"mb_per_s\": %.2f}%s\n",
+	       sd_strip_impl(), len, out_len / strip_iters, strip_iters,
+	       (unsigned long long)(dur / strip_iters), 1e3 * len * strip_iters / dur,
+	       last ? "" : ",");
+
+	free(entry);
+	free(html);
+}
+
+static void print_hist(struct sd_dict *dict)
+{
+	struct sd_hist h;
+	int point;
+
+	printf("\t\"stages\": {\n");
+
+	for (point = 0; point < SD_TRACE_CNT; point++) {
+		sd_get_hist(dict, point, &h);
+
+		printf("\t\t\"%s\": {\"samples\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+		       "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+		       sd_trace_point_name(point),
+		       (unsigned long long)h.cnt,
+		       (unsigned long long)(h.cnt ? h.sum_ns / h.cnt : 0),
+		       (unsigned long long)sd_hist_percentile(&h, 50),
+		       (unsigned long long)sd_hist_percentile(&h, 90),
+		       (unsigned long long)sd_hist_percentile(&h, 99),
+		       (unsigned long long)sd_hist_percentile(&h, 99.9),
+		       (unsigned long long)h.max_ns,
+		       point + 1 < SD_TRACE_CNT ? "," : "");
+	}
+
+	printf("\t}\n");
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] [dict_path/dict_name]\n\n", name);
+	printf("Benchmarks a dictionary, if no dictionary is passed a synthetic one is generated\n\n");
+	printf("Options:\n");
+	printf(" -s words  number of words in synthetic dictionary (default %u)\n", synth_words);
+	printf(" -c size   dictzip chunk size of synthetic dictionary\n");
+	printf(" -l iters  number of lookups per test (default %u)\n", lookup_iters);
+	printf(" -e iters  number of entries per test (default %u)\n", entry_iters);
+	printf(" -o iters  number of dictionary opens (default %u)\n", open_iters);
+	printf(" -x iters  number of markup strips (default %u)\n", strip_iters);
+	printf(" -X size   size of the stripped HTML entry (default %u)\n", strip_size);
+	printf(" -E kib    entry cache budget in KiB (default %u)\n", entry_cache_kib);
+	printf(" -r seed   random seed\n");
+	printf(" -H        record per stage latency histograms\n");
+	printf(" -h        prints this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char tmp_dir[] = "/tmp/sd-bench-XXXXXX";
+	const char *path, *name;
+	struct sd_dict *dict;
+	unsigned int seed = 0;
+	int opt, synth = 0;
+
+	while ((opt = getopt(argc, argv, "c:e:E:hHl:o:r:s:x:X:")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk_size = atoi(optarg);
+		break;
+		case 'e':
+			entry_iters = atoi(optarg);
+		break;
+		case 'E':
+			entry_cache_kib = atoi(optarg);
+		break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'H':
+			hist = 1;
+		break;
+		case 'l':
+			lookup_iters = atoi(optarg);
+		break;
+		case 'o':
+			open_iters = atoi(optarg);
+		break;
+		case 'r':
+			seed = atoi(optarg);
+		break;
+		case 's':
+			synth_words = atoi(optarg);
+		break;
+		case 'x':
+			strip_iters = atoi(optarg);
+		break;
+		case 'X':
+			strip_size = atoi(optarg);
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!lookup_iters || !entry_iters || !open_iters || !synth_words || !strip_iters) {
+		printf("Number of iterations must be non-zero\n");
+		return 1;
+	}
+
+	srandom(seed);
+
+	if (argv[optind]) {
+		char *slash = strrchr(argv[optind], '/');
+
+		if (slash) {
+			*slash = 0;
+			path = argv[optind];
+			name = slash + 1;
+		} else {
+			path = ".";
+			name = argv[optind];
+		}
+	} else {
+		if (!mkdtemp(tmp_dir)) {
+			printf("Failed to create temporary directory\n");
+			return 1;
+		}
+
+		path = tmp_dir;
+		name = "synth";
+		synth = 1;
+
+		if (gen_synth_dict(path, name)) {
+			printf("Failed to generate synthetic dictionary\n");
+			nftw(tmp_dir, rm_file, 16, FTW_DEPTH | FTW_PHYS);
+			return 1;
+		}
+	}
+
+	if (hist)
+		sd_set_trace(SD_TRACE_HIST, NULL, NULL);
+
+	printf("{\n");
+	printf("\t\"synthetic\": %s,\n", synth ? "true" : "false");
+	printf("\t\"histograms\": %s,\n", hist ? "true" : "false");
+
+	dict = bench_open(path, name);
+	if (!dict) {
+		printf("\t\"error\": \"Failed to open dictionary\"\n}\n");
+		if (synth)
+			nftw(tmp_dir, rm_file, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+
+	bench_lookup(dict);
+	bench_get_entry(dict, 0);
+	bench_strip(!hist);
+
+	if (hist)
+		print_hist(dict);
+
+	printf("}\n");
+
+	sd_close_dict(dict);
+
+	if (synth)
+		nftw(tmp_dir, rm_file, 16, FTW_DEPTH | FTW_PHYS);
+
+	return 0;
+}
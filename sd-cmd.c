@@ -5,31 +5,1154 @@
 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 #include "libstardict.h"
+#include "sd_util.h"
+
+static void print_stats(FILE *f, struct sd_dict *dict)
+{
+	struct sd_stats stats;
+
+	sd_get_stats(dict, &stats);
+
+	fprintf(f, "\nStatistics:\n");
+	fprintf(f, " lookups            %llu\n", (unsigned long long)stats.lookups);
+	fprintf(f, " entries            %llu\n", (unsigned long long)stats.entries);
+	fprintf(f, " cache hits         %llu\n", (unsigned long long)stats.cache_hits);
+	fprintf(f, " cache misses       %llu\n", (unsigned long long)stats.cache_misses);
+	fprintf(f, " cache evictions    %llu\n", (unsigned long long)stats.cache_evictions);
+	fprintf(f, " shm cache hits     %llu\n", (unsigned long long)stats.shm_hits);
+	fprintf(f, " shm cache misses   %llu\n", (unsigned long long)stats.shm_misses);
+	fprintf(f, " entry cache hits   %llu\n", (unsigned long long)stats.entry_cache_hits);
+	fprintf(f, " entry cache misses %llu\n", (unsigned long long)stats.entry_cache_misses);
+	fprintf(f, " filter rejects     %llu\n", (unsigned long long)stats.filter_rejects);
+	fprintf(f, " bytes compressed   %llu\n", (unsigned long long)stats.bytes_compressed);
+	fprintf(f, " bytes decompressed %llu\n", (unsigned long long)stats.bytes_decompressed);
+	fprintf(f, " read calls         %llu\n", (unsigned long long)stats.read_calls);
+	fprintf(f, " memory index       %zu\n", stats.mem_idx);
+	fprintf(f, " memory word list   %zu\n", stats.mem_word_list);
+	fprintf(f, " memory cache       %zu\n", stats.mem_cache);
+	fprintf(f, " memory entry cache %zu\n", stats.mem_entry_cache);
+	fprintf(f, " memory filter      %zu\n", stats.mem_filter);
+	fprintf(f, " memory total       %zu\n", stats.mem_total);
+}
+
+static void trace_cb(struct sd_dict *dict, enum sd_trace_point point,
+                     uint64_t duration_ns, uint64_t arg, void *priv)
+{
+	(void) dict;
+	(void) priv;
+
+	fprintf(stderr, "trace: %-10s %8llu ns arg=%llu\n", sd_trace_point_name(point),
+	        (unsigned long long)duration_ns, (unsigned long long)arg);
+}
+
+
+static int write_entry(const char *data, size_t size, void *priv)
+{
+	return fwrite(data, size, 1, priv) != 1;
+}
+
+/*
+ * Server protocol, each message is prefixed by a 32bit big endian length.
+ *
+ * Request: op (1 byte), dictionary index (16bit big endian), argument
+ * Reply: status (1 byte), data
+ *
+ * OP_LIST   - no argument, "idx\tbook_name\tword_count\n" per dictionary
+ * OP_LOOKUP - a word, "idx\tword\n" per word matching directly or by a synonym,
+ *             the best match is listed first, the rest in the index order
+ * OP_ENTRY  - a 32bit big endian word index, entry data
+ * OP_STRIP  - same as OP_ENTRY but with markup stripped
+ */
+#define OP_LIST 'D'
+#define OP_LOOKUP 'L'
+#define OP_ENTRY 'E'
+#define OP_STRIP 'S'
+
+#define ST_OK 0
+#define ST_NOT_FOUND 1
+#define ST_INVALID 2
+
+#define REQ_HDR_SIZE 3
+#define MSG_MAX 4096
+#define MAX_CLIENTS 1024
+
+struct buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static int buf_reserve(struct buf *self, size_t len)
+{
+	if (self->len + len > self->size) {
+		size_t new_size = self->size ? self->size : 1024;
+		char *new_data;
+
+		while (new_size < self->len + len)
+			new_size *= 2;
+
+		new_data = realloc(self->data, new_size);
+		if (!new_data)
+			return 1;
+
+		self->data = new_data;
+		self->size = new_size;
+	}
+
+	return 0;
+}
+
+static int buf_append(struct buf *self, const void *data, size_t len)
+{
+	if (buf_reserve(self, len))
+		return 1;
+
+	memcpy(self->data + self->len, data, len);
+	self->len += len;
+
+	return 0;
+}
+
+static void buf_consume(struct buf *self, size_t len)
+{
+	memmove(self->data, self->data + len, self->len - len);
+	self->len -= len;
+}
+
+__attribute__ ((format (printf, 2, 3)))
+static int buf_printf(struct buf *self, const char *fmt, ...)
+{
+	char line[512];
+	va_list va;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, va);
+	va_end(va);
+
+	if (len < 0)
+		return 1;
+
+	if ((size_t)len >= sizeof(line))
+		len = sizeof(line) - 1;
+
+	return buf_append(self, line, len);
+}
+
+static void put_be32(void *buf, uint32_t val)
+{
+	val = htonl(val);
+	memcpy(buf, &val, 4);
+}
+
+static uint32_t get_be32(const void *buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, 4);
+
+	return ntohl(val);
+}
+
+static int unix_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("Socket path '%s' too long\n", path);
+		return 1;
+	}
+
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+struct client {
+	int fd;
+	struct buf in;
+	struct buf out;
+};
+
+struct server {
+	unsigned int dict_cnt;
+	struct sd_dict **dicts;
+	unsigned int client_cnt;
+	struct client clients[MAX_CLIENTS];
+	struct pollfd fds[MAX_CLIENTS + 1];
+};
+
+static volatile sig_atomic_t server_stop;
+
+static void server_sig(int sig)
+{
+	(void) sig;
+	server_stop = 1;
+}
+
+static void reply_lookup(struct buf *out, struct sd_dict *dict, const char *word)
+{
+	unsigned int i, cnt, best, *idxs;
+
+	cnt = sd_lookup_merged(dict, word, &idxs, &best);
+	if (!cnt) {
+		out->data[out->len - 1] = ST_NOT_FOUND;
+		return;
+	}
+
+	buf_printf(out, "%u\t%s\n", best, sd_idx_to_word(dict, best));
+
+	for (i = 0; i < cnt; i++) {
+		if (idxs[i] != best)
+			buf_printf(out, "%u\t%s\n", idxs[i], sd_idx_to_word(dict, idxs[i]));
+	}
+
+	free(idxs);
+}
+
+static int append_entry(const char *data, size_t size, void *priv)
+{
+	return buf_append(priv, data, size);
+}
+
+/*
+ * Raw entries may contain binary data, these are streamed with their size
+ * while the stripped entries are always text.
+ */
+static void reply_entry(struct buf *out, struct sd_dict *dict, uint32_t idx, int strip)
+{
+	struct sd_entry *entry;
+	size_t len = out->len;
+
+	if (idx >= dict->word_count)
+		goto err;
+
+	if (!strip) {
+		if (sd_stream_entry(dict, idx, append_entry, out))
+			goto err;
+		return;
+	}
+
+	entry = sd_get_stripped_entry(dict, idx);
+	if (!entry)
+		goto err;
+
+	buf_append(out, entry->data, strlen(entry->data));
+
+	sd_free_entry(entry);
+	return;
+err:
+	out->len = len;
+	out->data[out->len - 1] = ST_NOT_FOUND;
+}
+
+static void server_request(struct server *self, struct buf *out, const char *req, size_t len)
+{
+	unsigned int d = (unsigned char)req[1] << 8 | (unsigned char)req[2];
+	size_t hdr = out->len;
+	char status = ST_OK;
+	char word[MSG_MAX];
+	unsigned int i;
+
+	if (buf_reserve(out, 5))
+		return;
+
+	buf_append(out, "\0\0\0\0", 4);
+	buf_append(out, &status, 1);
+
+	if (d >= self->dict_cnt) {
+		out->data[hdr + 4] = ST_INVALID;
+		goto exit;
+	}
+
+	switch (req[0]) {
+	case OP_LIST:
+		for (i = 0; i < self->dict_cnt; i++) {
+			buf_printf(out, "%u\t%s\t%u\n", i, self->dicts[i]->book_name,
+			           self->dicts[i]->word_count);
+		}
+	break;
+	case OP_LOOKUP:
+		memcpy(word, req + REQ_HDR_SIZE, len - REQ_HDR_SIZE);
+		word[len - REQ_HDR_SIZE] = 0;
+		reply_lookup(out, self->dicts[d], word);
+	break;
+	case OP_ENTRY:
+	case OP_STRIP:
+		if (len != REQ_HDR_SIZE + 4) {
+			out->data[hdr + 4] = ST_INVALID;
+			break;
+		}
+
+		reply_entry(out, self->dicts[d], get_be32(req + REQ_HDR_SIZE),
+		            req[0] == OP_STRIP);
+	break;
+	default:
+		out->data[hdr + 4] = ST_INVALID;
+	}
+
+exit:
+	put_be32(out->data + hdr, out->len - hdr - 4);
+}
+
+static void server_drop_client(struct server *self, unsigned int i)
+{
+	struct client *client = &self->clients[i];
+
+	close(client->fd);
+	free(client->in.data);
+	free(client->out.data);
+
+	self->client_cnt--;
+
+	if (i != self->client_cnt) {
+		self->clients[i] = self->clients[self->client_cnt];
+		self->fds[i + 1] = self->fds[self->client_cnt + 1];
+	}
+}
+
+static int server_write(struct client *client)
+{
+	ssize_t ret;
+
+	while (client->out.len) {
+		ret = send(client->fd, client->out.data, client->out.len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			return 1;
+		}
+
+		buf_consume(&client->out, ret);
+	}
+
+	return 0;
+}
+
+static int server_read(struct server *self, struct client *client)
+{
+	char buf[MSG_MAX];
+	ssize_t ret;
+	uint32_t len;
+
+	ret = recv(client->fd, buf, sizeof(buf), 0);
+	if (ret <= 0)
+		return ret < 0 && errno == EAGAIN ? 0 : 1;
+
+	if (buf_append(&client->in, buf, ret))
+		return 1;
+
+	while (client->in.len >= 4) {
+		len = get_be32(client->in.data);
+
+		if (len < REQ_HDR_SIZE || len > MSG_MAX)
+			return 1;
+
+		if (client->in.len < len + 4)
+			break;
+
+		server_request(self, &client->out, client->in.data + 4, len);
+		buf_consume(&client->in, len + 4);
+	}
+
+	return server_write(client);
+}
+
+static void server_accept(struct server *self, int sock)
+{
+	struct client *client;
+	int fd;
+
+	fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (self->client_cnt >= MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+
+	client = &self->clients[self->client_cnt];
+	memset(client, 0, sizeof(*client));
+	client->fd = fd;
+
+	self->fds[self->client_cnt + 1].fd = fd;
+	self->client_cnt++;
+}
+
+static int server_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t old_umask;
+	int sock, ret;
+
+	if (unix_addr(&addr, path))
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		printf("Failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Remove stale socket left behind by a server that is no longer running */
+	if (!connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		printf("Server already running at '%s'\n", path);
+		goto err;
+	}
+
+	if (errno == ECONNREFUSED) {
+		if (lstat(path, &st) || !S_ISSOCK(st.st_mode)) {
+			printf("Refusing to replace '%s', not a socket\n", path);
+			goto err;
+		}
+
+		unlink(path);
+	}
+
+	/* Only the user that runs the server can connect */
+	old_umask = umask(0177);
+	ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+
+	if (ret) {
+		printf("Failed to bind '%s': %s\n", path, strerror(errno));
+		goto err;
+	}
+
+	if (listen(sock, SOMAXCONN)) {
+		printf("Failed to listen on '%s': %s\n", path, strerror(errno));
+		goto err;
+	}
+
+	return sock;
+err:
+	close(sock);
+	return -1;
+}
+
+static int server_run(const char *path, struct sd_dict **dicts, unsigned int dict_cnt)
+{
+	struct sigaction sa = {.sa_handler = server_sig};
+	struct server *self;
+	unsigned int i;
+	int sock;
+
+	self = malloc(sizeof(*self));
+	if (!self) {
+		printf("Failed to allocate server\n");
+		return 1;
+	}
+
+	self->dicts = dicts;
+	self->dict_cnt = dict_cnt;
+	self->client_cnt = 0;
+
+	sock = server_listen(path);
+	if (sock < 0) {
+		free(self);
+		return 1;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Listening on '%s'\n", path);
+	fflush(stdout);
+
+	self->fds[0].fd = sock;
+	self->fds[0].events = POLLIN;
+
+	while (!server_stop) {
+		for (i = 0; i < self->client_cnt; i++)
+			self->fds[i + 1].events = self->clients[i].out.len ? POLLOUT : POLLIN;
+
+		if (poll(self->fds, self->client_cnt + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("Poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		/* Iterate backwards, dropped clients are replaced by the last one */
+		for (i = self->client_cnt; i > 0; i--) {
+			struct client *client = &self->clients[i - 1];
+			short revents = self->fds[i].revents;
+			int err = 0;
+
+			if (!revents)
+				continue;
+
+			if (revents & POLLOUT)
+				err = server_write(client);
+			else if (revents & (POLLIN | POLLHUP | POLLERR))
+				err = server_read(self, client);
+
+			if (err)
+				server_drop_client(self, i - 1);
+		}
+
+		if (self->fds[0].revents & POLLIN)
+			server_accept(self, sock);
+	}
+
+	while (self->client_cnt)
+		server_drop_client(self, 0);
+
+	close(sock);
+	unlink(path);
+	free(self);
+
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return 1;
+
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends a request and waits for a reply, the reply is returned as a null
+ * terminated string.
+ *
+ * Returns a reply status or -1 on a failure.
+ */
+static int client_request(int fd, char op, unsigned int d, const void *arg, size_t arg_len,
+                          struct buf *reply)
+{
+	char hdr[4 + REQ_HDR_SIZE];
+	uint32_t len;
+	char status;
+
+	if (arg_len + REQ_HDR_SIZE > MSG_MAX) {
+		printf("Request too long\n");
+		return -1;
+	}
+
+	put_be32(hdr, arg_len + REQ_HDR_SIZE);
+	hdr[4] = op;
+	hdr[5] = d >> 8;
+	hdr[6] = d;
+
+	if (write_all(fd, hdr, sizeof(hdr)) || write_all(fd, arg, arg_len))
+		goto err;
+
+	if (read_all(fd, hdr, 4))
+		goto err;
+
+	len = get_be32(hdr);
+	if (!len)
+		goto err;
+
+	if (read_all(fd, &status, 1))
+		goto err;
+
+	reply->len = 0;
+
+	/* Status is replaced by the null terminator */
+	if (buf_reserve(reply, len))
+		goto err;
+
+	if (read_all(fd, reply->data, len - 1))
+		goto err;
+
+	reply->data[len - 1] = 0;
+	reply->len = len - 1;
+
+	return status;
+err:
+	printf("Server connection failed\n");
+	return -1;
+}
+
+static int client_run(const char *path, unsigned int d, int raw_entry, const char *word)
+{
+	struct sockaddr_un addr;
+	struct buf reply = {};
+	uint32_t idx;
+	char idx_be[4];
+	int fd, ret = 1;
+
+	if (unix_addr(&addr, path))
+		return 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		printf("Failed to create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		printf("Failed to connect to '%s': %s\n", path, strerror(errno));
+		goto exit;
+	}
+
+	if (!word) {
+		if (client_request(fd, OP_LIST, 0, NULL, 0, &reply) == ST_OK) {
+			fputs(reply.data, stdout);
+			ret = 0;
+		}
+		goto exit;
+	}
+
+	switch (client_request(fd, OP_LOOKUP, d, word, strlen(word), &reply)) {
+	case ST_OK:
+	break;
+	case ST_NOT_FOUND:
+		printf("none\n");
+		goto exit;
+	case ST_INVALID:
+		printf("Dict index too large %u\n", d);
+		/* fallthrough */
+	default:
+		goto exit;
+	}
+
+	fputs(reply.data, stdout);
+
+	idx = strtoul(reply.data, NULL, 10);
+	put_be32(idx_be, idx);
+
+	if (client_request(fd, raw_entry ? OP_ENTRY : OP_STRIP, d, idx_be, 4, &reply) == ST_OK) {
+		fwrite(reply.data, reply.len, 1, stdout);
+		putchar('\n');
+		ret = 0;
+	}
+
+exit:
+	free(reply.data);
+	close(fd);
+	return ret;
+}
+
+static int server_main(const char *path, unsigned int *d_idxs, unsigned int d_cnt,
+                       const struct sd_open_opts *opts, int stats)
+{
+	struct sd_dict_paths paths;
+	struct sd_dict **dicts;
+	unsigned int i, d_idx, dict_cnt = 0;
+	int ret = 1, d_idxs_valid = 0;
+
+	sd_lookup_dict_paths(&paths);
+	if (!paths.paths) {
+		printf("No dictionaries found\n");
+		return 1;
+	}
+
+	/* Serve all dictionaries unless selected with -d */
+	if (!d_cnt)
+		d_cnt = paths.dict_cnt;
+	else
+		d_idxs_valid = 1;
+
+	dicts = calloc(d_cnt, sizeof(struct sd_dict *));
+	if (!dicts) {
+		printf("Failed to allocate dicts\n");
+		goto exit;
+	}
+
+	for (i = 0; i < d_cnt; i++) {
+		struct sd_dict_path *dict_path;
+
+		d_idx = d_idxs_valid ? d_idxs[i] : i;
+
+		if (d_idx >= paths.dict_cnt) {
+			printf("Dict index too large %u\n", d_idx);
+			goto exit;
+		}
+
+		dict_path = paths.paths[d_idx];
+
+		dicts[dict_cnt] = sd_open_dict_opts(dict_path->dir, dict_path->fname, opts);
+		if (!dicts[dict_cnt]) {
+			printf("Failed to load dict '%s'!\n", dict_path->fname);
+			goto exit;
+		}
+
+		printf(" %2u '%s' word count=%u\n", dict_cnt, dicts[dict_cnt]->book_name,
+		       dicts[dict_cnt]->word_count);
+
+		dict_cnt++;
+	}
+
+	ret = server_run(path, dicts, dict_cnt);
+
+	for (i = 0; stats && i < dict_cnt; i++)
+		print_stats(stdout, dicts[i]);
+
+exit:
+	for (i = 0; i < dict_cnt; i++)
+		sd_close_dict(dicts[i]);
+
+	free(dicts);
+	sd_free_dict_paths(&paths);
+
+	return ret;
+}
+
+/*
+ * Batch mode, queries are read from stdin one per line and processed by a
+ * pool of threads sharing the dictionary. The queries are processed in
+ * batches so that the output can be written in the input order.
+ */
+#define BATCH_SIZE 4096
+#define BATCH_THREADS_MAX 64
+
+enum batch_fmt {
+	BATCH_TSV,
+	BATCH_JSON,
+};
+
+struct batch {
+	struct sd_dict *dict;
+	enum batch_fmt fmt;
+	int raw_entry;
+	unsigned int cnt;
+	unsigned int next;
+	char *queries[BATCH_SIZE];
+	struct buf results[BATCH_SIZE];
+};
+
+/* Escapes the same characters sd-pack unescapes */
+static void buf_tsv_escape(struct buf *self, const char *str)
+{
+	size_t len;
+
+	for (;;) {
+		len = strcspn(str, "\n\t\\");
+		buf_append(self, str, len);
+		str += len;
+
+		switch (*str) {
+		case 0:
+			return;
+		case '\n':
+			buf_append(self, "\\n", 2);
+		break;
+		case '\t':
+			buf_append(self, "\\t", 2);
+		break;
+		case '\\':
+			buf_append(self, "\\\\", 2);
+		break;
+		}
+
+		str++;
+	}
+}
+
+static void buf_json_string(struct buf *self, const char *str)
+{
+	static const char json_special[] = "\"\\"
+		"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+		"\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f";
+	size_t len;
+
+	buf_append(self, "\"", 1);
+
+	for (;;) {
+		len = strcspn(str, json_special);
+		buf_append(self, str, len);
+		str += len;
+
+		switch (*str) {
+		case 0:
+			buf_append(self, "\"", 1);
+			return;
+		case '"':
+			buf_append(self, "\\\"", 2);
+		break;
+		case '\\':
+			buf_append(self, "\\\\", 2);
+		break;
+		case '\n':
+			buf_append(self, "\\n", 2);
+		break;
+		case '\t':
+			buf_append(self, "\\t", 2);
+		break;
+		default:
+			buf_printf(self, "\\u%04x", (unsigned char)*str);
+		}
+
+		str++;
+	}
+}
+
+static void batch_query(struct batch *self, unsigned int i)
+{
+	const char *query = self->queries[i];
+	struct buf *out = &self->results[i];
+	struct sd_entry *entry = NULL;
+	unsigned int *idxs = NULL, best;
+	const char *word = NULL;
+	unsigned int matches = 0;
+
+	if (query[0])
+		matches = sd_lookup_merged(self->dict, query, &idxs, &best);
+
+	free(idxs);
+
+	if (matches) {
+		word = sd_idx_to_word(self->dict, best);
+		if (self->raw_entry)
+			entry = sd_get_entry(self->dict, best);
+		else
+			entry = sd_get_stripped_entry(self->dict, best);
+	}
+
+	switch (self->fmt) {
+	case BATCH_TSV:
+		buf_tsv_escape(out, query);
+		buf_printf(out, "\t%u\t", matches);
+		if (word)
+			buf_tsv_escape(out, word);
+		buf_append(out, "\t", 1);
+		if (entry)
+			buf_tsv_escape(out, entry->data);
+		buf_append(out, "\n", 1);
+	break;
+	case BATCH_JSON:
+		buf_append(out, "{\"query\": ", 10);
+		buf_json_string(out, query);
+		buf_printf(out, ", \"matches\": %u", matches);
+		if (word) {
+			buf_append(out, ", \"word\": ", 10);
+			buf_json_string(out, word);
+		}
+		if (entry) {
+			buf_append(out, ", \"entry\": ", 11);
+			buf_json_string(out, entry->data);
+		}
+		buf_append(out, "}\n", 2);
+	break;
+	}
+
+	sd_free_entry(entry);
+}
+
+static void *batch_thread(void *priv)
+{
+	struct batch *self = priv;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&self->next, 1, __ATOMIC_RELAXED)) < self->cnt)
+		batch_query(self, i);
+
+	return NULL;
+}
+
+static void batch_process(struct batch *self, unsigned int threads_cnt)
+{
+	pthread_t threads[BATCH_THREADS_MAX];
+	unsigned int i, started = 0;
+
+	self->next = 0;
+
+	threads_cnt = MIN(threads_cnt, self->cnt);
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < threads_cnt; i++) {
+		if (pthread_create(&threads[started], NULL, batch_thread, self))
+			break;
+		started++;
+	}
+
+	batch_thread(self);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < self->cnt; i++) {
+		fwrite(self->results[i].data, self->results[i].len, 1, stdout);
+		self->results[i].len = 0;
+		free(self->queries[i]);
+	}
+
+	self->cnt = 0;
+}
+
+static int batch_run(struct sd_dict *dict, enum batch_fmt fmt, int raw_entry,
+                     unsigned int threads_cnt)
+{
+	struct batch *self = calloc(1, sizeof(struct batch));
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	unsigned int i;
+
+	if (!self) {
+		fprintf(stderr, "Failed to allocate batch\n");
+		return 1;
+	}
+
+	self->dict = dict;
+	self->fmt = fmt;
+	self->raw_entry = raw_entry;
+
+	while ((len = getline(&line, &size, stdin)) >= 0) {
+		while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = 0;
+
+		self->queries[self->cnt] = line;
+		line = NULL;
+		size = 0;
+
+		if (++self->cnt >= BATCH_SIZE)
+			batch_process(self, threads_cnt);
+	}
+
+	if (self->cnt)
+		batch_process(self, threads_cnt);
+
+	free(line);
+
+	for (i = 0; i < BATCH_SIZE; i++)
+		free(self->results[i].data);
+
+	free(self);
+
+	return 0;
+}
+
+static int batch_main(unsigned int d_idx, enum batch_fmt fmt, int raw_entry,
+                      unsigned int threads_cnt, const struct sd_open_opts *opts,
+                      int stats)
+{
+	struct sd_dict_paths paths;
+	struct sd_dict *dict;
+	int ret;
+
+	sd_lookup_dict_paths(&paths);
+	if (!paths.paths) {
+		fprintf(stderr, "No dictionaries found\n");
+		return 1;
+	}
+
+	if (d_idx >= paths.dict_cnt) {
+		fprintf(stderr, "Dict index too large %u\n", d_idx);
+		sd_free_dict_paths(&paths);
+		return 1;
+	}
+
+	dict = sd_open_dict_opts(paths.paths[d_idx]->dir, paths.paths[d_idx]->fname, opts);
+	sd_free_dict_paths(&paths);
+	if (!dict) {
+		fprintf(stderr, "Failed to load dict!\n");
+		return 1;
+	}
+
+	if (!threads_cnt) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads_cnt = cpus > 0 ? cpus : 1;
+	}
+
+	threads_cnt = MIN(threads_cnt, BATCH_THREADS_MAX);
+
+	ret = batch_run(dict, fmt, raw_entry, threads_cnt);
+
+	if (stats)
+		print_stats(stderr, dict);
+
+	sd_close_dict(dict);
+
+	return ret;
+}
+
+static int print_match(unsigned int idx, const char *word, void *priv)
+{
+	(void) priv;
+
+	printf("%u\t%s\n", idx, word);
+
+	return 0;
+}
+
+static void search_words(struct sd_dict *dict, const char *pattern, unsigned int flags,
+                         unsigned int limit, unsigned int threads_cnt)
+{
+	int ret;
+
+	printf("Search '%s' ...\n", pattern);
+
+	ret = sd_search(dict, pattern, flags, limit, threads_cnt, print_match, NULL);
+	if (ret < 0)
+		printf("Invalid pattern\n");
+	else
+		printf("%i matches\n", ret);
+}
+
+static int parse_idx_mem(const char *str, unsigned int *idx_mem)
+{
+	static const char *const names[] = {
+		[SD_IDX_HEAP] = "heap",
+		[SD_IDX_MMAP] = "mmap",
+		[SD_IDX_MMAP_POPULATE] = "populate",
+		[SD_IDX_MMAP_LOCK] = "lock",
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names)/sizeof(*names); i++) {
+		if (!strcmp(str, names[i])) {
+			*idx_mem = i;
+			return 0;
+		}
+	}
+
+	return 1;
+}
 
 int main(int argc, char *argv[])
 {
 	struct sd_dict_paths paths;
 	struct sd_dict *dict;
-	unsigned int i, d_idx = 0, raw_entry = 0;
+	unsigned int i, d_idx = 0, raw_entry = 0, stats = 0, d_cnt = 0;
+	unsigned int d_idxs[argc];
+	unsigned int batch = 0, threads_cnt = 0;
+	unsigned int search = 0, search_flags = 0, search_limit = 0;
+	struct sd_open_opts opts = {};
+	enum batch_fmt fmt = BATCH_TSV;
+	const char *server = NULL, *client = NULL;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "d:r")) != -1) {
+	while ((opt = getopt(argc, argv, "bc:C:d:e:fgi:j:lm:Mn:o:rS:stx")) != -1) {
 		switch (opt) {
+		case 'b':
+			batch = 1;
+		break;
+		case 'c':
+			opts.chunk_cache = (size_t)atoi(optarg) << 20;
+		break;
+		case 'C':
+			client = optarg;
+		break;
 		case 'd':
 			d_idx = atoi(optarg);
+			d_idxs[d_cnt++] = d_idx;
+		break;
+		case 'e':
+			opts.entry_cache = (size_t)atoi(optarg) << 20;
+		break;
+		case 'f':
+			opts.filter = SD_FILTER_BUILD | SD_FILTER_CACHE;
+		break;
+		case 'g':
+			search = 1;
+			search_flags = 0;
+		break;
+		case 'i':
+			if (parse_idx_mem(optarg, &opts.idx_mem)) {
+				printf("Invalid idx residency '%s'\n", optarg);
+				return 1;
+			}
+		break;
+		case 'j':
+			threads_cnt = atoi(optarg);
+		break;
+		case 'l':
+			opts.flags |= SD_OPEN_LAZY_INDEX;
+		break;
+		case 'm':
+			opts.shm_cache = atoi(optarg);
+		break;
+		case 'M':
+			opts.flags |= SD_OPEN_MMAP | SD_OPEN_DICT_RANDOM;
+		break;
+		case 'n':
+			search_limit = atoi(optarg);
+		break;
+		case 'o':
+			if (!strcmp(optarg, "tsv")) {
+				fmt = BATCH_TSV;
+			} else if (!strcmp(optarg, "json")) {
+				fmt = BATCH_JSON;
+			} else {
+				printf("Invalid output format '%s'\n", optarg);
+				return 1;
+			}
+		break;
+		case 'S':
+			server = optarg;
 		break;
 		case 'r':
 			raw_entry = 1;
 		break;
+		case 's':
+			stats = 1;
+		break;
+		case 't':
+			sd_set_trace(SD_TRACE_CB, trace_cb, NULL);
+		break;
+		case 'x':
+			search = 1;
+			search_flags = SD_SEARCH_REGEX;
+		break;
 		default:
 			printf("Invalid option %c\n", opt);
 		}
 	}
 
+	if (client)
+		return client_run(client, d_idx, raw_entry, argv[optind]);
+
+	if (server)
+		return server_main(server, d_idxs, d_cnt, &opts, stats);
+
+	if (batch)
+		return batch_main(d_idx, fmt, raw_entry, threads_cnt, &opts, stats);
+
 	sd_lookup_dict_paths(&paths);
 	if (!paths.paths) {
 		printf("No dictionaries found\n");
@@ -49,7 +1172,7 @@ int main(int argc, char *argv[])
 
 	printf("Opening dict '%s'\n", paths.paths[d_idx]->fname);
 
-	dict = sd_open_dict(paths.paths[d_idx]->dir, paths.paths[d_idx]->fname);
+	dict = sd_open_dict_opts(paths.paths[d_idx]->dir, paths.paths[d_idx]->fname, &opts);
 	if (!dict) {
 		printf("Failed to load dict!\n");
 		return 1;
@@ -61,36 +1184,52 @@ int main(int argc, char *argv[])
 
 	printf("Dict loaded word count=%u\n", dict->word_count);
 
-	struct sd_lookup_res res;
+	unsigned int *idxs, best;
 
 	if (!argv[optind])
-		return 0;
+		goto exit;
+
+	if (search) {
+		search_words(dict, argv[optind], search_flags, search_limit, threads_cnt);
+		goto exit;
+	}
 
 	printf("Lookup '%s' ... ", argv[optind]);
 
-	int ret = sd_lookup(dict, argv[optind], &res);
+	unsigned int ret = sd_lookup_merged(dict, argv[optind], &idxs, &best);
 
 	if (!ret) {
 		printf("none\n");
-		return 0;
+		goto exit;
 	} else {
-		printf("%i\n", sd_lookup_res_cnt(&res));
+		printf("%u\n", ret);
 	}
 
-	printf("Result %u - %u\n", res.min, res.max);
-	printf("%s - %s\n", sd_idx_to_word(dict, res.min), sd_idx_to_word(dict, res.max));
+	for (unsigned int i = 0; i < ret; i++)
+		printf("%u %s\n", idxs[i], sd_idx_to_word(dict, idxs[i]));
+
+	free(idxs);
 
-	for (unsigned int i = res.min; i <= res.max; i++)
-		printf("%s\n", sd_idx_to_word(dict, i));
+	printf("Best match %s\n", sd_idx_to_word(dict, best));
 
-	struct sd_entry *entry = sd_get_entry(dict, res.min);
+	/* Raw entries are written out as they are decompressed */
+	if (raw_entry) {
+		if (!sd_stream_entry(dict, best, write_entry, stdout))
+			printf("\n");
+		goto exit;
+	}
+
+	struct sd_entry *entry = sd_get_entry(dict, best);
 	if (entry) {
-		if (!raw_entry)
-			sd_strip_entry(entry);
+		sd_strip_entry(entry);
 		printf("%s\n", entry->data);
 	}
 
 	sd_free_entry(entry);
+exit:
+	if (stats)
+		print_stats(stdout, dict);
+
 	sd_close_dict(dict);
 
 	return 0;
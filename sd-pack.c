@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libstardict.h"
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] out_dir dict_name\n\n", name);
+	printf("Builds a stardict dictionary from 'headword<TAB>definition' lines\n");
+	printf("read from stdin, escapes \\n, \\t and \\\\ are recognized in the\n");
+	printf("definition.\n\n");
+	printf("Options:\n");
+	printf(" -b book_name  dictionary name, defaults to dict_name\n");
+	printf(" -f fmt        entry format character, defaults to 'm' (plain text)\n");
+	printf(" -c size       dictzip chunk size in bytes (max 58315)\n");
+	printf(" -z            write gzipped index (idx.gz)\n");
+	printf(" -r path/name  repack an existing dictionary instead of reading stdin\n");
+	printf(" -h            prints this help\n");
+}
+
+static size_t unescape(char *str)
+{
+	char *i, *c;
+
+	for (i = c = str; *i; i++) {
+		if (*i != '\\' || !i[1]) {
+			*(c++) = *i;
+			continue;
+		}
+
+		switch (*(++i)) {
+		case 'n':
+			*(c++) = '\n';
+		break;
+		case 't':
+			*(c++) = '\t';
+		break;
+		default:
+			*(c++) = *i;
+		}
+	}
+
+	*c = 0;
+
+	return c - str;
+}
+
+static int pack_stdin(struct sd_writer *writer)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	unsigned int lineno = 0;
+	int ret = 0;
+
+	while ((len = getline(&line, &line_size, stdin)) > 0) {
+		lineno++;
+
+		if (line[len-1] == '\n')
+			line[--len] = 0;
+
+		if (!len)
+			continue;
+
+		char *def = strchr(line, '\t');
+		if (!def) {
+			printf("Missing definition on line %u\n", lineno);
+			ret = 1;
+			break;
+		}
+
+		*(def++) = 0;
+
+		if (sd_writer_add(writer, line, def, unescape(def))) {
+			ret = 1;
+			break;
+		}
+	}
+
+	free(line);
+
+	return ret;
+}
+
+struct pack_state {
+	struct sd_writer *writer;
+	char *last;
+	size_t last_size;
+	size_t last_alloc;
+	int has_last;
+};
+
+/*
+ * Headwords that share the data are visited one after another, these are
+ * stored as aliases so that the data are written only once.
+ */
+static int pack_entry(unsigned int idx, const char *word,
+                      const char *data, size_t size, void *priv)
+{
+	struct pack_state *state = priv;
+
+	(void) idx;
+
+	if (state->has_last && state->last_size == size &&
+	    !memcmp(state->last, data, size))
+		return sd_writer_add_alias(state->writer, word);
+
+	if (size > state->last_alloc) {
+		char *last = realloc(state->last, size);
+
+		if (!last) {
+			printf("Failed to allocate entry buffer\n");
+			return 1;
+		}
+
+		state->last = last;
+		state->last_alloc = size;
+	}
+
+	memcpy(state->last, data, size);
+	state->last_size = size;
+	state->has_last = 1;
+
+	return sd_writer_add(state->writer, word, data, size);
+}
+
+static int pack_dict(struct sd_writer *writer, struct sd_dict *dict)
+{
+	struct pack_state state = {.writer = writer};
+	int ret = 0;
+
+	/* The writer sorts the index, entries are read in the data order */
+	if (sd_foreach_entry(dict, pack_entry, &state)) {
+		printf("Failed to read entries\n");
+		ret = 1;
+	}
+
+	free(state.last);
+
+	return ret;
+}
+
+static struct sd_dict *open_src(char *src)
+{
+	char *name = strrchr(src, '/');
+
+	if (!name)
+		return sd_open_dict(".", src);
+
+	*(name++) = 0;
+
+	return sd_open_dict(src, name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *book_name = NULL;
+	char entry_fmt = SD_ENTRY_UTF8_TEXT;
+	unsigned int chunk_size = 0;
+	int gzip_idx = 0, opt, ret;
+	char *src_path = NULL;
+	struct sd_dict *src = NULL;
+	struct sd_writer *writer;
+
+	while ((opt = getopt(argc, argv, "b:c:f:hr:z")) != -1) {
+		switch (opt) {
+		case 'b':
+			book_name = optarg;
+		break;
+		case 'c':
+			chunk_size = atoi(optarg);
+		break;
+		case 'f':
+			entry_fmt = optarg[0];
+		break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case 'r':
+			src_path = optarg;
+		break;
+		case 'z':
+			gzip_idx = 1;
+		break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (src_path) {
+		src = open_src(src_path);
+		if (!src) {
+			printf("Failed to load dict!\n");
+			return 1;
+		}
+
+		if (!book_name)
+			book_name = src->book_name;
+
+		entry_fmt = src->entry_fmt;
+	}
+
+	if (!book_name)
+		book_name = argv[optind+1];
+
+	writer = sd_writer_open(argv[optind], argv[optind+1], book_name, entry_fmt);
+	if (!writer) {
+		sd_close_dict(src);
+		return 1;
+	}
+
+	if (chunk_size && sd_writer_set_chunk_size(writer, chunk_size)) {
+		sd_close_dict(src);
+		sd_writer_close(writer);
+		return 1;
+	}
+
+	sd_writer_set_gzip_idx(writer, gzip_idx);
+
+	if (src)
+		ret = pack_dict(writer, src);
+	else
+		ret = pack_stdin(writer);
+
+	if (sd_writer_close(writer))
+		ret = 1;
+
+	sd_close_dict(src);
+
+	return ret;
+}
@@ -0,0 +1,703 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+#define MANIFEST_NAME "dict_paths"
+#define MANIFEST_MAGIC "libstardict dict paths 2\n"
+
+int sd_parse_bookname(const char *path, const char *fname, char *book_name)
+{
+	char *ifo_path = sd_aprintf("%s/%s.ifo", path, fname);
+	FILE *ifo;
+	char line[128];
+	int ret = 0;
+
+	if (!ifo_path) {
+		ret = 1;
+		goto err0;
+	}
+
+	ifo = fopen(ifo_path, "r");
+	if (!ifo) {
+		sd_err("Failed to open '%s': %s", ifo_path, strerror(errno));
+		ret = 1;
+		goto err1;
+	}
+
+	while (fgets(line, sizeof(line), ifo)) {
+		if (sscanf(line, "bookname=%63[^\n]s\n", book_name) == 1)
+			break;
+	}
+
+	ret = book_name[0] == 0;
+
+	if (ret)
+		sd_err("Invalid ifo file '%s.ifo'", fname);
+
+	fclose(ifo);
+err1:
+	free(ifo_path);
+err0:
+	return ret;
+}
+
+struct sd_dict_path *sd_new_dict_path(const char *dir, const char *fname, size_t len)
+{
+	struct sd_dict_path *path = malloc(sizeof(struct sd_dict_path) + len + 1);
+
+	if (!path)
+		return NULL;
+
+	memset(path, 0, sizeof(*path));
+
+	memcpy(path->fname, fname, len);
+	path->fname[len] = 0;
+	path->dir = dir;
+
+	return path;
+}
+
+int sd_dict_paths_append(struct sd_dict_paths *paths, unsigned int *size,
+                         struct sd_dict_path *path)
+{
+	if (paths->dict_cnt >= *size) {
+		unsigned int new_size = *size ? 2 * *size : 16;
+		struct sd_dict_path **new_paths;
+
+		new_paths = realloc(paths->paths, new_size * sizeof(struct sd_dict_path *));
+		if (!new_paths)
+			return 1;
+
+		paths->paths = new_paths;
+		*size = new_size;
+	}
+
+	paths->paths[paths->dict_cnt++] = path;
+
+	return 0;
+}
+
+static void dir_lookup(struct sd_dict_paths *paths, unsigned int *size, const char *dir_path)
+{
+	struct dirent *entry;
+	DIR *dir = opendir(dir_path);
+
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		size_t len = strlen(entry->d_name);
+
+		if (len < 4)
+			continue;
+
+		if (strcmp(entry->d_name + len - 4, ".ifo"))
+			continue;
+
+		struct sd_dict_path *path = sd_new_dict_path(dir_path, entry->d_name, len - 4);
+
+		if (!path)
+			continue;
+
+		if (sd_dict_paths_append(paths, size, path))
+			free(path);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Manifest caches the list of dictionaries for each directory along with the
+ * directory mtime and the mtime and size of each ifo file. Adding, removing or
+ * renaming a file in a directory changes its mtime while an in-place edit of
+ * an ifo file changes the file mtime, in both cases the directory is scanned
+ * again.
+ *
+ * The manifest consists of records, strings are length prefixed so that any
+ * characters can be stored:
+ *
+ * d mtime_sec mtime_nsec path_len:path\n
+ * f mtime_sec mtime_nsec ifo_size fname_len book_name_len:fnamebook_name\n
+ *
+ * Each directory record is followed by records for the dictionaries in it.
+ */
+struct manifest_entry {
+	char *fname;
+	char book_name[SD_DICT_BOOKNAME_MAX];
+	struct timespec mtime;
+	off_t size;
+};
+
+struct manifest_dir {
+	char *path;
+	struct timespec mtime;
+	unsigned int first;
+	unsigned int cnt;
+};
+
+struct manifest {
+	struct manifest_dir *dirs;
+	unsigned int dirs_cnt;
+	struct manifest_entry *entries;
+	unsigned int entries_cnt;
+	unsigned int entries_size;
+	int dirty;
+};
+
+static char *cache_path(void)
+{
+	const char *cache = getenv("XDG_CACHE_HOME");
+
+	if (cache && cache[0])
+		return sd_aprintf("%s/libstardict", cache);
+
+	cache = getenv("HOME");
+	if (!cache)
+		return NULL;
+
+	return sd_aprintf("%s/.cache/libstardict", cache);
+}
+
+char *sd_cache_file(const char *name)
+{
+	char *dir = cache_path();
+	char *ret;
+
+	if (!dir)
+		return NULL;
+
+	ret = sd_aprintf("%s/%s", dir, name);
+
+	free(dir);
+
+	return ret;
+}
+
+int sd_cache_mkdir(void)
+{
+	char *dir = cache_path();
+	char *slash;
+
+	if (!dir)
+		return 1;
+
+	for (slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (slash)
+			*slash = 0;
+
+		if (mkdir(dir, 0755) && errno != EEXIST) {
+			free(dir);
+			return 1;
+		}
+
+		if (!slash)
+			break;
+
+		*slash = '/';
+	}
+
+	free(dir);
+	return 0;
+}
+
+static void manifest_free(struct manifest *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->dirs_cnt; i++)
+		free(self->dirs[i].path);
+
+	for (i = 0; i < self->entries_cnt; i++)
+		free(self->entries[i].fname);
+
+	free(self->dirs);
+	free(self->entries);
+}
+
+static struct manifest_entry *manifest_new_entry(struct manifest *self)
+{
+	if (self->entries_cnt >= self->entries_size) {
+		unsigned int new_size = self->entries_size ? 2 * self->entries_size : 16;
+		struct manifest_entry *entries;
+
+		entries = realloc(self->entries, new_size * sizeof(*entries));
+		if (!entries)
+			return NULL;
+
+		self->entries = entries;
+		self->entries_size = new_size;
+	}
+
+	return &self->entries[self->entries_cnt++];
+}
+
+static struct manifest_dir *manifest_new_dir(struct manifest *self)
+{
+	struct manifest_dir *dirs;
+
+	dirs = realloc(self->dirs, (self->dirs_cnt + 1) * sizeof(*dirs));
+	if (!dirs)
+		return NULL;
+
+	self->dirs = dirs;
+
+	return &self->dirs[self->dirs_cnt++];
+}
+
+#define MANIFEST_STR_MAX 4096
+
+static int manifest_read_str(FILE *f, char *buf, size_t len)
+{
+	if (len && fread(buf, len, 1, f) != 1)
+		return 1;
+
+	buf[len] = 0;
+
+	/* Embedded null bytes would silently truncate the string */
+	return strlen(buf) != len;
+}
+
+static int manifest_read_dir(struct manifest *self, FILE *f)
+{
+	struct manifest_dir *dir;
+	long long sec, nsec;
+	size_t len;
+
+	if (fscanf(f, " %lld %lld %zu:", &sec, &nsec, &len) != 3 ||
+	    !len || len >= MANIFEST_STR_MAX)
+		return 1;
+
+	dir = manifest_new_dir(self);
+	if (!dir)
+		return 1;
+
+	dir->path = malloc(len + 1);
+	dir->mtime.tv_sec = sec;
+	dir->mtime.tv_nsec = nsec;
+	dir->first = self->entries_cnt;
+	dir->cnt = 0;
+
+	if (!dir->path || manifest_read_str(f, dir->path, len)) {
+		free(dir->path);
+		self->dirs_cnt--;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int manifest_read_entry(struct manifest *self, FILE *f)
+{
+	struct manifest_dir *dir = self->dirs_cnt ? &self->dirs[self->dirs_cnt - 1] : NULL;
+	struct manifest_entry *entry;
+	long long sec, nsec, size;
+	size_t fname_len, book_name_len;
+
+	if (!dir)
+		return 1;
+
+	if (fscanf(f, " %lld %lld %lld %zu %zu:", &sec, &nsec, &size,
+	           &fname_len, &book_name_len) != 5)
+		return 1;
+
+	if (!fname_len || fname_len >= MANIFEST_STR_MAX ||
+	    !book_name_len || book_name_len >= SD_DICT_BOOKNAME_MAX)
+		return 1;
+
+	entry = manifest_new_entry(self);
+	if (!entry)
+		return 1;
+
+	entry->fname = malloc(fname_len + 1);
+	entry->mtime.tv_sec = sec;
+	entry->mtime.tv_nsec = nsec;
+	entry->size = size;
+
+	if (!entry->fname || manifest_read_str(f, entry->fname, fname_len) ||
+	    manifest_read_str(f, entry->book_name, book_name_len)) {
+		free(entry->fname);
+		self->entries_cnt--;
+		return 1;
+	}
+
+	dir->cnt++;
+
+	return 0;
+}
+
+static void manifest_load(struct manifest *self)
+{
+	char *path = sd_cache_file(MANIFEST_NAME);
+	char magic[sizeof(MANIFEST_MAGIC)];
+	int type;
+	FILE *f;
+
+	memset(self, 0, sizeof(*self));
+
+	if (!path)
+		return;
+
+	f = fopen(path, "r");
+	free(path);
+
+	if (!f)
+		return;
+
+	if (!fgets(magic, sizeof(magic), f) || strcmp(magic, MANIFEST_MAGIC))
+		goto exit;
+
+	while ((type = fgetc(f)) != EOF) {
+		switch (type) {
+		case 'd':
+			if (manifest_read_dir(self, f))
+				goto err;
+		break;
+		case 'f':
+			if (manifest_read_entry(self, f))
+				goto err;
+		break;
+		default:
+			goto err;
+		}
+
+		if (fgetc(f) != '\n')
+			goto err;
+	}
+
+	goto exit;
+err:
+	sd_err("Invalid dictionary manifest");
+	manifest_free(self);
+	memset(self, 0, sizeof(*self));
+exit:
+	fclose(f);
+}
+
+static struct manifest_dir *manifest_lookup(struct manifest *self, const char *dir_path)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->dirs_cnt; i++) {
+		if (!strcmp(self->dirs[i].path, dir_path))
+			return &self->dirs[i];
+	}
+
+	return NULL;
+}
+
+static int same_mtime(const struct timespec *mtime, const struct stat *st)
+{
+	return mtime->tv_sec == st->st_mtim.tv_sec &&
+	       mtime->tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int stat_ifo(const char *dir_path, const char *fname, struct stat *st)
+{
+	char *ifo_path = sd_aprintf("%s/%s.ifo", dir_path, fname);
+	int ret;
+
+	if (!ifo_path)
+		return 1;
+
+	ret = stat(ifo_path, st);
+
+	free(ifo_path);
+
+	return ret;
+}
+
+static int manifest_dir_valid(struct manifest *self, struct manifest_dir *dir,
+                              const char *dir_path, struct stat *st)
+{
+	struct stat ifo_st;
+	unsigned int i;
+
+	if (!same_mtime(&dir->mtime, st))
+		return 0;
+
+	for (i = 0; i < dir->cnt; i++) {
+		struct manifest_entry *entry = &self->entries[dir->first + i];
+
+		if (stat_ifo(dir_path, entry->fname, &ifo_st))
+			return 0;
+
+		if (!same_mtime(&entry->mtime, &ifo_st) || entry->size != ifo_st.st_size)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Fills in dictionaries for a directory from the manifest, returns non-zero if
+ * the directory has to be scanned.
+ */
+static int manifest_dir_lookup(struct manifest *self, struct sd_dict_paths *paths,
+                               unsigned int *size, const char *dir_path)
+{
+	struct manifest_dir *dir = manifest_lookup(self, dir_path);
+	struct stat st;
+	unsigned int i;
+
+	if (stat(dir_path, &st)) {
+		/* Directory was removed */
+		if (dir)
+			self->dirty = 1;
+		return 0;
+	}
+
+	if (!dir || !manifest_dir_valid(self, dir, dir_path, &st)) {
+		self->dirty = 1;
+		return 1;
+	}
+
+	for (i = 0; i < dir->cnt; i++) {
+		struct manifest_entry *entry = &self->entries[dir->first + i];
+		struct sd_dict_path *path;
+
+		path = sd_new_dict_path(dir_path, entry->fname, strlen(entry->fname));
+		if (!path)
+			continue;
+
+		strcpy(path->book_name, entry->book_name);
+
+		if (sd_dict_paths_append(paths, size, path))
+			free(path);
+	}
+
+	return 0;
+}
+
+/*
+ * A file modified in the last second before the scan may be modified again
+ * without a change in mtime on filesystems with coarse timestamps, such file
+ * is never valid in the manifest.
+ */
+static void manifest_mtime(struct stat *st, time_t scan_start)
+{
+	if (st->st_mtim.tv_sec >= scan_start - 1)
+		st->st_mtim.tv_sec = st->st_mtim.tv_nsec = -1;
+}
+
+static void manifest_write_dir(FILE *f, struct sd_dict_paths *paths,
+                               const char *dir_path, time_t scan_start)
+{
+	struct stat st;
+	unsigned int i;
+
+	if (stat(dir_path, &st))
+		return;
+
+	manifest_mtime(&st, scan_start);
+
+	fprintf(f, "d %lld %lld %zu:%s\n", (long long)st.st_mtim.tv_sec,
+	        (long long)st.st_mtim.tv_nsec, strlen(dir_path), dir_path);
+
+	for (i = 0; i < paths->dict_cnt; i++) {
+		struct sd_dict_path *path = paths->paths[i];
+
+		if (strcmp(path->dir, dir_path))
+			continue;
+
+		if (stat_ifo(dir_path, path->fname, &st))
+			st.st_mtim.tv_sec = st.st_mtim.tv_nsec = st.st_size = -1;
+		else
+			manifest_mtime(&st, scan_start);
+
+		fprintf(f, "f %lld %lld %lld %zu %zu:%s%s\n",
+		        (long long)st.st_mtim.tv_sec, (long long)st.st_mtim.tv_nsec,
+		        (long long)st.st_size, strlen(path->fname),
+		        strlen(path->book_name), path->fname, path->book_name);
+	}
+}
+
+static void manifest_write(struct sd_dict_paths *paths, const char *dirs[],
+                           time_t scan_start)
+{
+	char *path = sd_cache_file(MANIFEST_NAME);
+	char *tmp_path = sd_cache_file(MANIFEST_NAME ".tmp");
+	unsigned int i;
+	FILE *f;
+
+	if (!path || !tmp_path || sd_cache_mkdir())
+		goto exit;
+
+	f = fopen(tmp_path, "w");
+	if (!f)
+		goto exit;
+
+	fprintf(f, MANIFEST_MAGIC);
+
+	for (i = 0; dirs[i]; i++)
+		manifest_write_dir(f, paths, dirs[i], scan_start);
+
+	if (fclose(f) || rename(tmp_path, path))
+		unlink(tmp_path);
+exit:
+	free(tmp_path);
+	free(path);
+}
+
+struct parse_ctx {
+	struct sd_dict_path **paths;
+	unsigned int cnt;
+	unsigned int next;
+};
+
+static void *parse_thread(void *priv)
+{
+	struct parse_ctx *ctx = priv;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->cnt) {
+		struct sd_dict_path *path = ctx->paths[i];
+
+		if (!path->book_name[0])
+			sd_parse_bookname(path->dir, path->fname, path->book_name);
+	}
+
+	return NULL;
+}
+
+#define PARSE_THREADS_MAX 8
+
+static void parse_booknames(struct sd_dict_paths *paths, unsigned int first, int parallel)
+{
+	struct parse_ctx ctx = {
+		.paths = paths->paths + first,
+		.cnt = paths->dict_cnt - first,
+	};
+	pthread_t threads[PARSE_THREADS_MAX];
+	unsigned int i, threads_cnt = 0;
+
+	if (parallel) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads_cnt = MIN(ctx.cnt / 4, PARSE_THREADS_MAX);
+		if (cpus > 0)
+			threads_cnt = MIN(threads_cnt, (unsigned int)cpus);
+	}
+
+	for (i = 0; i < threads_cnt; i++) {
+		if (pthread_create(&threads[i], NULL, parse_thread, &ctx))
+			break;
+	}
+
+	threads_cnt = i;
+
+	/* The calling thread parses as well */
+	parse_thread(&ctx);
+
+	for (i = 0; i < threads_cnt; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Drops dictionaries without a valid ifo file.
+ */
+static void compact_paths(struct sd_dict_paths *paths, unsigned int first)
+{
+	unsigned int i, j;
+
+	for (i = j = first; i < paths->dict_cnt; i++) {
+		if (!paths->paths[i]->book_name[0]) {
+			free(paths->paths[i]);
+			continue;
+		}
+
+		paths->paths[j++] = paths->paths[i];
+	}
+
+	paths->dict_cnt = j;
+}
+
+void sd_scan_dict_paths(struct sd_dict_paths *paths, unsigned int flags)
+{
+	char *home = getenv("HOME");
+	struct manifest manifest = {};
+	time_t scan_start = time(NULL);
+	unsigned int i, size = 0, home_cnt = 0, dirs_cnt = 0;
+	const char *dirs[3] = {};
+
+	paths->dict_cnt = 0;
+	paths->home_sd_dir = home ? sd_aprintf("%s/%s", home, SD_DICT_USER_DIR) : NULL;
+	paths->paths = NULL;
+
+	if (paths->home_sd_dir)
+		dirs[dirs_cnt++] = paths->home_sd_dir;
+
+	dirs[dirs_cnt++] = SD_DICT_DIR;
+
+	if (flags & SD_SCAN_CACHE)
+		manifest_load(&manifest);
+
+	for (i = 0; dirs[i]; i++) {
+		unsigned int first = paths->dict_cnt;
+
+		if ((flags & SD_SCAN_CACHE) &&
+		    !manifest_dir_lookup(&manifest, paths, &size, dirs[i]))
+			goto next;
+
+		dir_lookup(paths, &size, dirs[i]);
+		parse_booknames(paths, first, flags & SD_SCAN_PARALLEL);
+		compact_paths(paths, first);
+next:
+		if (dirs[i] == paths->home_sd_dir)
+			home_cnt = paths->dict_cnt;
+	}
+
+	/*
+	 * Missing directories are not written into the manifest, the lookup
+	 * marks the manifest dirty when a directory appears, disappears or
+	 * changes, so the number of directories is not compared here.
+	 */
+	if ((flags & SD_SCAN_CACHE) && manifest.dirty)
+		manifest_write(paths, dirs, scan_start);
+
+	manifest_free(&manifest);
+
+	if (paths->home_sd_dir && !home_cnt) {
+		free(paths->home_sd_dir);
+		paths->home_sd_dir = NULL;
+	}
+
+	if (!paths->dict_cnt) {
+		free(paths->paths);
+		paths->paths = NULL;
+	}
+}
+
+void sd_lookup_dict_paths(struct sd_dict_paths *paths)
+{
+	sd_scan_dict_paths(paths, 0);
+}
+
+void sd_free_dict_paths(struct sd_dict_paths *paths)
+{
+	unsigned int i;
+
+	free(paths->home_sd_dir);
+
+	for (i = 0; i < paths->dict_cnt; i++)
+		free(paths->paths[i]);
+
+	free(paths->paths);
+}
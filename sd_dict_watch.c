@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* Waits for the next path component of a missing directory to appear */
+#define PARENT_MASK (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD)
+
+/*
+ * A dictionary directory, if it does not exist the closest existing parent is
+ * watched instead.
+ */
+struct watch_dir {
+	int wd;
+	int parent_wd;
+	const char *path;
+};
+
+struct sd_dict_watch {
+	int fd;
+	struct sd_dict_paths *paths;
+	/* allocated size of the paths array */
+	unsigned int paths_size;
+	unsigned int dirs_cnt;
+	struct watch_dir dirs[2];
+};
+
+static const char *suffixes[] = {
+	".ifo",
+	".idx",
+	".idx.gz",
+	".dict.dz",
+	".syn",
+	NULL
+};
+
+/*
+ * Returns the length of the dictionary name for a dictionary file or zero if
+ * the file is not part of a dictionary.
+ */
+static size_t dict_name_len(const char *fname)
+{
+	size_t len = strlen(fname);
+	unsigned int i;
+
+	for (i = 0; suffixes[i]; i++) {
+		size_t suffix_len = strlen(suffixes[i]);
+
+		if (len > suffix_len && !strcmp(fname + len - suffix_len, suffixes[i]))
+			return len - suffix_len;
+	}
+
+	return 0;
+}
+
+static int file_exists(const char *dir, const char *name, size_t len, const char *suffix)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (snprintf(path, sizeof(path), "%s/%.*s%s", dir, (int)len, name, suffix) >= (int)sizeof(path))
+		return 0;
+
+	return !stat(path, &st);
+}
+
+/*
+ * Dictionary files are not installed atomically, the dictionary is reported
+ * once all of them are in place.
+ */
+static int dict_complete(const char *dir, const char *name, size_t len)
+{
+	if (!file_exists(dir, name, len, ".ifo"))
+		return 0;
+
+	if (!file_exists(dir, name, len, ".dict.dz"))
+		return 0;
+
+	return file_exists(dir, name, len, ".idx") ||
+	       file_exists(dir, name, len, ".idx.gz");
+}
+
+static int find_path(struct sd_dict_paths *paths, const char *dir, const char *name, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < paths->dict_cnt; i++) {
+		struct sd_dict_path *path = paths->paths[i];
+
+		if (strcmp(path->dir, dir))
+			continue;
+
+		if (!strncmp(path->fname, name, len) && !path->fname[len])
+			return i;
+	}
+
+	return -1;
+}
+
+static void remove_path(struct sd_dict_watch *self, unsigned int i,
+                        sd_dict_watch_cb cb, void *priv)
+{
+	struct sd_dict_paths *paths = self->paths;
+	struct sd_dict_path *path = paths->paths[i];
+
+	memmove(&paths->paths[i], &paths->paths[i+1],
+	        (paths->dict_cnt - i - 1) * sizeof(struct sd_dict_path *));
+
+	paths->dict_cnt--;
+
+	cb(SD_DICT_REMOVED, path, priv);
+
+	free(path);
+}
+
+static void add_path(struct sd_dict_watch *self, const char *dir, const char *name, size_t len,
+                     sd_dict_watch_cb cb, void *priv)
+{
+	struct sd_dict_paths *paths = self->paths;
+	struct sd_dict_path *path = sd_new_dict_path(dir, name, len);
+
+	if (!path)
+		return;
+
+	if (sd_parse_bookname(dir, path->fname, path->book_name) ||
+	    sd_dict_paths_append(paths, &self->paths_size, path)) {
+		free(path);
+		return;
+	}
+
+	cb(SD_DICT_ADDED, path, priv);
+}
+
+static void update_dict(struct sd_dict_watch *self, const char *dir, const char *fname,
+                        sd_dict_watch_cb cb, void *priv)
+{
+	size_t len = dict_name_len(fname);
+	int i;
+
+	if (!len)
+		return;
+
+	i = find_path(self->paths, dir, fname, len);
+
+	/*
+	 * Any change in a file of a known dictionary invalidates dictionaries
+	 * opened by the application, it's reported as a removal followed by an
+	 * addition. A rewritten ifo may also change the book name.
+	 */
+	if (i >= 0)
+		remove_path(self, i, cb, priv);
+
+	if (dict_complete(dir, fname, len))
+		add_path(self, dir, fname, len, cb, priv);
+}
+
+/*
+ * Synchronizes paths with a directory content, used when inotify events were
+ * lost.
+ */
+static void rescan_dir(struct sd_dict_watch *self, const char *dir_path,
+                       sd_dict_watch_cb cb, void *priv)
+{
+	struct sd_dict_paths *paths = self->paths;
+	struct dirent *entry;
+	unsigned int i;
+	DIR *dir;
+
+	for (i = 0; i < paths->dict_cnt;) {
+		struct sd_dict_path *path = paths->paths[i];
+
+		if (!strcmp(path->dir, dir_path) &&
+		    !dict_complete(dir_path, path->fname, strlen(path->fname))) {
+			remove_path(self, i, cb, priv);
+			continue;
+		}
+
+		i++;
+	}
+
+	dir = opendir(dir_path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		size_t len = strlen(entry->d_name);
+
+		if (len < 4 || strcmp(entry->d_name + len - 4, ".ifo"))
+			continue;
+
+		if (find_path(paths, dir_path, entry->d_name, len - 4) >= 0)
+			continue;
+
+		if (dict_complete(dir_path, entry->d_name, len - 4))
+			add_path(self, dir_path, entry->d_name, len - 4, cb, priv);
+	}
+
+	closedir(dir);
+}
+
+static int wd_used(struct sd_dict_watch *self, int wd)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->dirs_cnt; i++) {
+		if (self->dirs[i].wd == wd || self->dirs[i].parent_wd == wd)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void rm_parent_watch(struct sd_dict_watch *self, struct watch_dir *dir)
+{
+	int wd = dir->parent_wd;
+
+	dir->parent_wd = -1;
+
+	/* Both directories may be waiting on the same parent */
+	if (wd >= 0 && !wd_used(self, wd))
+		inotify_rm_watch(self->fd, wd);
+}
+
+/*
+ * Watches the closest existing parent of a missing directory, the watch moves
+ * down the path as the directories are created.
+ */
+static void add_parent_watch(struct sd_dict_watch *self, struct watch_dir *dir)
+{
+	char parent[PATH_MAX];
+	char *slash;
+	int wd = -1;
+
+	if (snprintf(parent, sizeof(parent), "%s", dir->path) >= (int)sizeof(parent))
+		return;
+
+	while (wd < 0 && (slash = strrchr(parent, '/'))) {
+		slash[slash == parent] = 0;
+
+		wd = inotify_add_watch(self->fd, parent, PARENT_MASK);
+		if (wd < 0 && errno != ENOENT && errno != ENOTDIR) {
+			sd_err("Failed to watch '%s': %s", parent, strerror(errno));
+			return;
+		}
+
+		if (slash == parent)
+			break;
+	}
+
+	if (wd == dir->parent_wd)
+		return;
+
+	rm_parent_watch(self, dir);
+	dir->parent_wd = wd;
+}
+
+/*
+ * Returns non-zero if the directory is watched now.
+ */
+static int add_watch(struct sd_dict_watch *self, struct watch_dir *dir)
+{
+	dir->wd = inotify_add_watch(self->fd, dir->path, WATCH_MASK);
+
+	if (dir->wd >= 0) {
+		rm_parent_watch(self, dir);
+		return 1;
+	}
+
+	if (errno != ENOENT && errno != ENOTDIR)
+		sd_err("Failed to watch '%s': %s", dir->path, strerror(errno));
+
+	add_parent_watch(self, dir);
+
+	return 0;
+}
+
+static void init_watch(struct sd_dict_watch *self, const char *path)
+{
+	struct watch_dir *dir = &self->dirs[self->dirs_cnt++];
+
+	dir->wd = -1;
+	dir->parent_wd = -1;
+	dir->path = path;
+
+	add_watch(self, dir);
+}
+
+struct sd_dict_watch *sd_dict_watch_new(struct sd_dict_paths *paths)
+{
+	struct sd_dict_watch *self = malloc(sizeof(struct sd_dict_watch));
+	char *home = getenv("HOME");
+
+	if (!self) {
+		sd_err("Failed to allocate watch");
+		return NULL;
+	}
+
+	memset(self, 0, sizeof(*self));
+
+	self->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (self->fd < 0) {
+		sd_err("Failed to initialize inotify: %s", strerror(errno));
+		free(self);
+		return NULL;
+	}
+
+	self->paths = paths;
+	self->paths_size = paths->dict_cnt;
+
+	/*
+	 * The home directory is freed by the lookup when there were no
+	 * dictionaries, but we need it for dictionaries added later.
+	 */
+	if (!paths->home_sd_dir && home)
+		paths->home_sd_dir = sd_aprintf("%s/%s", home, SD_DICT_USER_DIR);
+
+	if (paths->home_sd_dir)
+		init_watch(self, paths->home_sd_dir);
+
+	init_watch(self, SD_DICT_DIR);
+
+	return self;
+}
+
+int sd_dict_watch_fd(struct sd_dict_watch *self)
+{
+	return self->fd;
+}
+
+/*
+ * A directory on the path to a missing dictionary directory was created or
+ * a watched directory or its parent went away.
+ */
+static void update_watch(struct sd_dict_watch *self, struct watch_dir *dir,
+                         sd_dict_watch_cb cb, void *priv)
+{
+	if (dir->wd >= 0)
+		return;
+
+	/* The directory may have been populated before the watch was added */
+	if (add_watch(self, dir))
+		rescan_dir(self, dir->path, cb, priv);
+}
+
+static void process_event(struct sd_dict_watch *self, const struct inotify_event *ev,
+                          sd_dict_watch_cb cb, void *priv)
+{
+	unsigned int i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		for (i = 0; i < self->dirs_cnt; i++) {
+			update_watch(self, &self->dirs[i], cb, priv);
+			rescan_dir(self, self->dirs[i].path, cb, priv);
+		}
+		return;
+	}
+
+	for (i = 0; i < self->dirs_cnt; i++) {
+		struct watch_dir *dir = &self->dirs[i];
+
+		if (ev->wd == dir->wd) {
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				if (!(ev->mask & IN_IGNORED))
+					inotify_rm_watch(self->fd, dir->wd);
+
+				dir->wd = -1;
+				rescan_dir(self, dir->path, cb, priv);
+				update_watch(self, dir, cb, priv);
+				continue;
+			}
+
+			if (ev->len)
+				update_dict(self, dir->path, ev->name, cb, priv);
+
+			continue;
+		}
+
+		if (ev->wd == dir->parent_wd) {
+			if (ev->mask & IN_IGNORED)
+				dir->parent_wd = -1;
+
+			update_watch(self, dir, cb, priv);
+		}
+	}
+}
+
+int sd_dict_watch_process(struct sd_dict_watch *self, sd_dict_watch_cb cb, void *priv)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int cnt = 0;
+
+	for (;;) {
+		len = read(self->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN)
+				return cnt;
+
+			if (errno == EINTR)
+				continue;
+
+			sd_err("Failed to read inotify events: %s", strerror(errno));
+			return -1;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			cnt++;
+
+			process_event(self, ev, cb, priv);
+		}
+	}
+}
+
+void sd_dict_watch_free(struct sd_dict_watch *self)
+{
+	if (!self)
+		return;
+
+	close(self->fd);
+	free(self);
+}
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * LRU cache of decoded entries.
+ *
+ * The entries are keyed by an index and a stripped flag, i.e. raw and
+ * stripped variant of an entry are cached separately. The lookup is a hash
+ * table with chaining, the recently used order is kept in a doubly linked
+ * list and the least recently used entries are evicted once the sum of the
+ * entry sizes would exceed the memory budget.
+ *
+ * The nodes are immutable once inserted and reference counted, a hit takes a
+ * reference under the lock and copies the entry after the lock is released,
+ * so that the threads do not serialize on the copies. An evicted node is
+ * freed once the last reader drops its reference.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+struct cache_node {
+	/* next node in the hash chain */
+	struct cache_node *hnext;
+	/* LRU list, head is the most recently used */
+	struct cache_node *prev;
+	struct cache_node *next;
+	unsigned int idx;
+	int stripped;
+	/* one reference for the cache and one for each reader */
+	unsigned int refs;
+	size_t size;
+	char fmt;
+	char data[];
+};
+
+struct sd_entry_cache {
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t used;
+	unsigned int cnt;
+	unsigned int bucket_cnt;
+	struct cache_node **buckets;
+	struct cache_node lru;
+};
+
+#define MIN_BUCKETS 64
+
+static size_t node_size(size_t size)
+{
+	return sizeof(struct cache_node) + size + 1;
+}
+
+static unsigned int hash(unsigned int idx, int stripped, unsigned int bucket_cnt)
+{
+	uint32_t key = (idx << 1) | !!stripped;
+
+	return (key * 2654435761u) & (bucket_cnt - 1);
+}
+
+static void lru_unlink(struct cache_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+static void lru_push(struct sd_entry_cache *self, struct cache_node *node)
+{
+	node->next = self->lru.next;
+	node->prev = &self->lru;
+	self->lru.next->prev = node;
+	self->lru.next = node;
+}
+
+static struct cache_node **find(struct sd_entry_cache *self, unsigned int idx, int stripped)
+{
+	struct cache_node **node = &self->buckets[hash(idx, stripped, self->bucket_cnt)];
+
+	for (; *node; node = &(*node)->hnext) {
+		if ((*node)->idx == idx && (*node)->stripped == stripped)
+			return node;
+	}
+
+	return node;
+}
+
+static void rehash(struct sd_entry_cache *self)
+{
+	unsigned int i, bucket_cnt = self->bucket_cnt * 2;
+	struct cache_node **buckets = calloc(bucket_cnt, sizeof(*buckets));
+
+	/* Longer chains are not fatal */
+	if (!buckets)
+		return;
+
+	for (i = 0; i < self->bucket_cnt; i++) {
+		struct cache_node *node = self->buckets[i];
+
+		while (node) {
+			struct cache_node *next = node->hnext;
+			unsigned int h = hash(node->idx, node->stripped, bucket_cnt);
+
+			node->hnext = buckets[h];
+			buckets[h] = node;
+			node = next;
+		}
+	}
+
+	free(self->buckets);
+	self->buckets = buckets;
+	self->bucket_cnt = bucket_cnt;
+}
+
+static void node_unref(struct cache_node *node)
+{
+	if (!__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL))
+		free(node);
+}
+
+static void evict(struct sd_entry_cache *self)
+{
+	struct cache_node *node = self->lru.prev;
+	struct cache_node **pnode = find(self, node->idx, node->stripped);
+
+	*pnode = node->hnext;
+	lru_unlink(node);
+
+	self->used -= node_size(node->size);
+	self->cnt--;
+
+	node_unref(node);
+}
+
+struct sd_entry_cache *sd_entry_cache_new(size_t budget)
+{
+	struct sd_entry_cache *self = malloc(sizeof(*self));
+
+	if (!self) {
+		sd_err("Failed to allocate entry cache");
+		return NULL;
+	}
+
+	self->buckets = calloc(MIN_BUCKETS, sizeof(*self->buckets));
+	if (!self->buckets) {
+		sd_err("Failed to allocate entry cache");
+		free(self);
+		return NULL;
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+	self->budget = budget;
+	self->used = 0;
+	self->cnt = 0;
+	self->bucket_cnt = MIN_BUCKETS;
+	self->lru.next = &self->lru;
+	self->lru.prev = &self->lru;
+
+	return self;
+}
+
+struct sd_entry *sd_entry_cache_get(struct sd_entry_cache *self, unsigned int idx, int stripped)
+{
+	struct sd_entry *res = NULL;
+	struct cache_node *node;
+
+	pthread_mutex_lock(&self->lock);
+
+	node = *find(self, idx, stripped);
+	if (!node) {
+		pthread_mutex_unlock(&self->lock);
+		return NULL;
+	}
+
+	lru_unlink(node);
+	lru_push(self, node);
+
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&self->lock);
+
+	res = malloc(sizeof(struct sd_entry) + node->size + 1);
+	if (res) {
+		res->fmt = node->fmt;
+		memcpy(res->data, node->data, node->size + 1);
+	}
+
+	node_unref(node);
+
+	return res;
+}
+
+void sd_entry_cache_put(struct sd_entry_cache *self, unsigned int idx, int stripped,
+                        const struct sd_entry *entry, size_t size)
+{
+	struct cache_node **pnode, *node;
+
+	if (node_size(size) > self->budget)
+		return;
+
+	node = malloc(node_size(size));
+	if (!node)
+		return;
+
+	node->idx = idx;
+	node->stripped = stripped;
+	node->refs = 1;
+	node->size = size;
+	node->fmt = entry->fmt;
+	memcpy(node->data, entry->data, size);
+	node->data[size] = 0;
+
+	pthread_mutex_lock(&self->lock);
+
+	/* The entry may have been inserted by another thread meanwhile */
+	pnode = find(self, idx, stripped);
+	if (*pnode) {
+		pthread_mutex_unlock(&self->lock);
+		free(node);
+		return;
+	}
+
+	while (self->used + node_size(size) > self->budget)
+		evict(self);
+
+	if (self->cnt >= self->bucket_cnt)
+		rehash(self);
+
+	pnode = &self->buckets[hash(idx, stripped, self->bucket_cnt)];
+	node->hnext = *pnode;
+	*pnode = node;
+
+	lru_push(self, node);
+
+	self->used += node_size(size);
+	self->cnt++;
+
+	pthread_mutex_unlock(&self->lock);
+}
+
+size_t sd_entry_cache_mem(struct sd_entry_cache *self)
+{
+	size_t ret;
+
+	if (!self)
+		return 0;
+
+	pthread_mutex_lock(&self->lock);
+	ret = sizeof(*self) + self->used + self->bucket_cnt * sizeof(*self->buckets);
+	pthread_mutex_unlock(&self->lock);
+
+	return ret;
+}
+
+void sd_entry_cache_free(struct sd_entry_cache *self)
+{
+	struct cache_node *node, *next;
+
+	if (!self)
+		return;
+
+	for (node = self->lru.next; node != &self->lru; node = next) {
+		next = node->next;
+		node_unref(node);
+	}
+
+	pthread_mutex_destroy(&self->lock);
+	free(self->buckets);
+	free(self);
+}
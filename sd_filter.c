@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Prefix filter that rejects lookups that cannot match.
+ *
+ * The filter is a split block Bloom filter, each key sets one bit in each of
+ * the eight 64bit words of a single 64 byte block, hence a query touches a
+ * single cache line. The keys are case folded prefixes of the headwords and
+ * synonyms, the prefix lengths are taken from the filter_lens[] table and
+ * a lookup checks the longest prefix of the query that is in the table. A
+ * query that is shorter than the shortest length always passes.
+ *
+ * The lookups compare words with strncasecmp() so the keys are folded the
+ * same way, ASCII letters are converted to lowercase and all bytes outside
+ * of ASCII are mapped to a single value, which keeps the filter correct for
+ * any folding of the non-ASCII bytes done by the current locale.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+#define FILTER_MAGIC 0x53444246
+#define FILTER_VERSION 1
+
+/* Roughly 0.5% false positive rate */
+#define FILTER_BITS_PER_KEY 12
+
+#define BLOCK_WORDS 8
+
+struct filter_block {
+	uint64_t words[BLOCK_WORDS];
+};
+
+struct sd_filter {
+	uint32_t block_cnt;
+	uint32_t key_cnt;
+	struct filter_block *blocks;
+};
+
+struct filter_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_cnt;
+	uint32_t key_cnt;
+};
+
+static const uint8_t filter_lens[] = {1, 2, 3, 4, 6, 8, 12, 16};
+
+#define FILTER_LENS (sizeof(filter_lens)/sizeof(*filter_lens))
+#define FILTER_LEN_MAX 16
+
+static const uint32_t salts[BLOCK_WORDS] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static inline uint8_t fold(uint8_t c)
+{
+	if (c >= 0x80)
+		return 0x80;
+
+	if (c >= 'A' && c <= 'Z')
+		return c + 'a' - 'A';
+
+	return c;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t hash_step(uint64_t h, char c)
+{
+	return (h ^ fold(c)) * 0x100000001b3ULL;
+}
+
+static inline uint64_t hash_final(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static uint64_t hash(const char *str, size_t len)
+{
+	uint64_t h = HASH_INIT;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = hash_step(h, str[i]);
+
+	return hash_final(h);
+}
+
+static struct filter_block *get_block(struct sd_filter *self, uint64_t h)
+{
+	return &self->blocks[((h >> 32) * self->block_cnt) >> 32];
+}
+
+static void insert(struct sd_filter *self, uint64_t h)
+{
+	struct filter_block *block = get_block(self, h);
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_WORDS; i++)
+		block->words[i] |= 1ULL << (((uint32_t)h * salts[i]) >> 26);
+}
+
+static int contains(struct sd_filter *self, uint64_t h)
+{
+	struct filter_block *block = get_block(self, h);
+	uint64_t missing = 0;
+	unsigned int i;
+
+	/* Checking all words without branches is faster than an early exit */
+	for (i = 0; i < BLOCK_WORDS; i++)
+		missing |= ~block->words[i] & (1ULL << (((uint32_t)h * salts[i]) >> 26));
+
+	return !missing;
+}
+
+/*
+ * Length of the common folded prefix, capped to the longest key length.
+ */
+static size_t common_prefix(const char *a, const char *b)
+{
+	size_t i;
+
+	for (i = 0; i < FILTER_LEN_MAX && a[i] && b[i]; i++) {
+		if (fold(a[i]) != fold(b[i]))
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * The lists are sorted case insensitively so the words that share a folded
+ * prefix are next to each other and each key is visited once. Unsorted
+ * lists only cause duplicate insertions.
+ */
+static uint32_t add_keys(struct sd_filter *self, char **list, unsigned int cnt)
+{
+	const char *prev = "";
+	uint32_t keys = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < cnt; i++) {
+		size_t same = common_prefix(prev, list[i]);
+		size_t len = strnlen(list[i], FILTER_LEN_MAX);
+		uint64_t h = HASH_INIT;
+		size_t hashed = 0;
+
+		for (j = 0; j < FILTER_LENS && filter_lens[j] <= len; j++) {
+			if (filter_lens[j] <= same)
+				continue;
+
+			keys++;
+
+			if (!self)
+				continue;
+
+			/* All prefixes of the word are hashed in a single pass */
+			for (; hashed < filter_lens[j]; hashed++)
+				h = hash_step(h, list[i][hashed]);
+
+			insert(self, hash_final(h));
+		}
+
+		prev = list[i];
+	}
+
+	return keys;
+}
+
+static struct sd_filter *filter_alloc(uint32_t block_cnt, uint32_t key_cnt)
+{
+	struct sd_filter *self = malloc(sizeof(*self));
+
+	if (!self) {
+		sd_err("Failed to allocate filter");
+		return NULL;
+	}
+
+	self->blocks = aligned_alloc(sizeof(struct filter_block),
+	                             block_cnt * sizeof(struct filter_block));
+	if (!self->blocks) {
+		sd_err("Failed to allocate filter");
+		free(self);
+		return NULL;
+	}
+
+	self->block_cnt = block_cnt;
+	self->key_cnt = key_cnt;
+
+	return self;
+}
+
+struct sd_filter *sd_filter_build(struct sd_dict *dict)
+{
+	struct sd_filter *self;
+	uint64_t bits;
+	uint32_t keys;
+
+	keys = add_keys(NULL, dict->word_list, dict->word_count) +
+	       add_keys(NULL, dict->syn_list, dict->syn_count);
+
+	bits = (uint64_t)keys * FILTER_BITS_PER_KEY;
+
+	self = filter_alloc((bits + 511) / 512 + 1, keys);
+	if (!self)
+		return NULL;
+
+	memset(self->blocks, 0, self->block_cnt * sizeof(struct filter_block));
+
+	add_keys(self, dict->word_list, dict->word_count);
+	add_keys(self, dict->syn_list, dict->syn_count);
+
+	return self;
+}
+
+int sd_filter_may_match(struct sd_filter *self, const char *prefix)
+{
+	size_t len = strnlen(prefix, FILTER_LEN_MAX);
+	int i;
+
+	for (i = FILTER_LENS - 1; i >= 0; i--) {
+		if (filter_lens[i] <= len)
+			return contains(self, hash(prefix, filter_lens[i]));
+	}
+
+	return 1;
+}
+
+struct sd_filter *sd_filter_load(const char *path)
+{
+	struct filter_hdr hdr;
+	struct sd_filter *self = NULL;
+	size_t size;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		goto exit;
+
+	if (hdr.magic != FILTER_MAGIC || hdr.version != FILTER_VERSION || !hdr.block_cnt)
+		goto exit;
+
+	self = filter_alloc(hdr.block_cnt, hdr.key_cnt);
+	if (!self)
+		goto exit;
+
+	size = hdr.block_cnt * sizeof(struct filter_block);
+
+	if (fread(self->blocks, size, 1, f) != 1 || fgetc(f) != EOF) {
+		sd_err("Filter cache '%s' is truncated", path);
+		sd_filter_free(self);
+		self = NULL;
+	}
+exit:
+	fclose(f);
+	return self;
+}
+
+int sd_filter_store(struct sd_filter *self, const char *path)
+{
+	char *tmp_path = sd_aprintf("%s.tmp", path);
+	struct filter_hdr hdr = {
+		.magic = FILTER_MAGIC,
+		.version = FILTER_VERSION,
+		.block_cnt = self->block_cnt,
+		.key_cnt = self->key_cnt,
+	};
+	size_t size = self->block_cnt * sizeof(struct filter_block);
+	FILE *f;
+	int ret = 1;
+
+	if (!tmp_path)
+		return 1;
+
+	f = fopen(tmp_path, "wb");
+	if (!f)
+		goto exit;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(self->blocks, size, 1, f) != 1) {
+		fclose(f);
+		unlink(tmp_path);
+		goto exit;
+	}
+
+	if (fclose(f) || rename(tmp_path, path)) {
+		unlink(tmp_path);
+		goto exit;
+	}
+
+	ret = 0;
+exit:
+	free(tmp_path);
+	return ret;
+}
+
+size_t sd_filter_mem(struct sd_filter *self)
+{
+	if (!self)
+		return 0;
+
+	return sizeof(*self) + self->block_cnt * sizeof(struct filter_block);
+}
+
+void sd_filter_free(struct sd_filter *self)
+{
+	if (!self)
+		return;
+
+	free(self->blocks);
+	free(self);
+}
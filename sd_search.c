@@ -0,0 +1,775 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Glob and regular expression headword search.
+ *
+ * Both pattern kinds compile into a sequence of atoms, i.e. a character, any
+ * character or a character class, each of them with an optional ?, * or +
+ * quantifier. There are no groups nor alternations hence the matcher is a
+ * NFA that keeps the set of active atoms in a bitmask and advances all of
+ * them at once with a few bit operations per character, i.e. the matching
+ * time is linear in the word length regardless of the pattern.
+ *
+ * The words are matched by UTF-8 characters and ASCII letters are compared
+ * case insensitively the same way sd_lookup() does.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+enum atom_type {
+	ATOM_CHAR,
+	ATOM_ANY,
+	ATOM_CLASS,
+};
+
+enum atom_quant {
+	QUANT_ONE,
+	/* ? zero or one */
+	QUANT_OPT,
+	/* * zero or more */
+	QUANT_STAR,
+	/* + one or more */
+	QUANT_PLUS,
+};
+
+struct atom {
+	uint8_t type;
+	uint8_t quant;
+	uint8_t negate;
+	uint8_t range_cnt;
+	/* character or the first range for a class */
+	uint32_t c;
+};
+
+struct range {
+	uint32_t min;
+	uint32_t max;
+};
+
+/* The accepting state is one bit past the last atom */
+#define ATOMS_MAX 63
+#define RANGES_MAX 256
+
+struct sd_pattern {
+	unsigned int atom_cnt;
+	int anchor_start;
+	int anchor_end;
+	/* atoms that may be skipped and atoms that may repeat */
+	uint64_t skip_mask;
+	uint64_t loop_mask;
+	/* states reachable from the start */
+	uint64_t start;
+	/* atoms matching an ASCII character */
+	uint64_t ascii_masks[128];
+	struct atom atoms[ATOMS_MAX];
+	unsigned int range_cnt;
+	struct range ranges[RANGES_MAX];
+	/* literal text every match starts or ends with */
+	char prefix[SD_SEARCH_PREFIX_MAX + 1];
+	char suffix[SD_SEARCH_PREFIX_MAX + 1];
+	size_t suffix_len;
+};
+
+static inline uint32_t fold(uint32_t c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c + 'a' - 'A';
+
+	return c;
+}
+
+/*
+ * Decodes an UTF-8 character, invalid bytes are returned one by one.
+ */
+static inline uint32_t utf8_next(const char **str)
+{
+	const uint8_t *s = (const uint8_t *)*str;
+	unsigned int len, i;
+	uint32_t c = s[0];
+
+	if (c < 0x80) {
+		*str += 1;
+		return c;
+	}
+
+	if (c >= 0xc2 && c <= 0xdf) {
+		len = 2;
+		c &= 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		len = 3;
+		c &= 0x0f;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		len = 4;
+		c &= 0x07;
+	} else {
+		*str += 1;
+		return c;
+	}
+
+	for (i = 1; i < len; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			*str += 1;
+			return s[0];
+		}
+
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+
+	*str += len;
+	return c;
+}
+
+static size_t utf8_put(char *buf, uint32_t c)
+{
+	if (c < 0x80) {
+		buf[0] = c;
+		return 1;
+	}
+
+	if (c < 0x800) {
+		buf[0] = 0xc0 | (c >> 6);
+		buf[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+
+	if (c < 0x10000) {
+		buf[0] = 0xe0 | (c >> 12);
+		buf[1] = 0x80 | ((c >> 6) & 0x3f);
+		buf[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+
+	buf[0] = 0xf0 | (c >> 18);
+	buf[1] = 0x80 | ((c >> 12) & 0x3f);
+	buf[2] = 0x80 | ((c >> 6) & 0x3f);
+	buf[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+static struct atom *new_atom(struct sd_pattern *self, enum atom_type type)
+{
+	struct atom *atom;
+
+	if (self->atom_cnt >= ATOMS_MAX) {
+		sd_err("Search pattern too long");
+		return NULL;
+	}
+
+	atom = &self->atoms[self->atom_cnt++];
+	atom->type = type;
+	atom->quant = QUANT_ONE;
+	atom->negate = 0;
+	atom->range_cnt = 0;
+	atom->c = 0;
+
+	return atom;
+}
+
+/*
+ * Parses a [] class, the str points after the opening bracket.
+ */
+static const char *parse_class(struct sd_pattern *self, const char *str, int glob)
+{
+	struct atom *atom = new_atom(self, ATOM_CLASS);
+	const char *start;
+
+	if (!atom)
+		return NULL;
+
+	atom->c = self->range_cnt;
+
+	if (*str == '^' || (glob && *str == '!')) {
+		atom->negate = 1;
+		str++;
+	}
+
+	start = str;
+
+	while (*str && (*str != ']' || str == start)) {
+		struct range *range;
+		uint32_t min, max;
+
+		if (*str == '\\' && str[1])
+			str++;
+
+		min = max = utf8_next(&str);
+
+		if (str[0] == '-' && str[1] && str[1] != ']') {
+			str++;
+
+			if (*str == '\\' && str[1])
+				str++;
+
+			max = utf8_next(&str);
+		}
+
+		if (min > max) {
+			sd_err("Invalid search pattern range");
+			return NULL;
+		}
+
+		if (self->range_cnt >= RANGES_MAX || atom->range_cnt >= UINT8_MAX) {
+			sd_err("Too many search pattern ranges");
+			return NULL;
+		}
+
+		range = &self->ranges[self->range_cnt++];
+		range->min = min;
+		range->max = max;
+		atom->range_cnt++;
+	}
+
+	if (*str != ']') {
+		sd_err("Unterminated [ in search pattern");
+		return NULL;
+	}
+
+	return str + 1;
+}
+
+static int parse_glob(struct sd_pattern *self, const char *str)
+{
+	struct atom *atom;
+
+	self->anchor_start = 1;
+	self->anchor_end = 1;
+
+	while (*str) {
+		switch (*str) {
+		case '*':
+			/* Consecutive stars are the same as a single one */
+			if (self->atom_cnt && self->atoms[self->atom_cnt - 1].quant == QUANT_STAR) {
+				str++;
+				continue;
+			}
+
+			atom = new_atom(self, ATOM_ANY);
+			if (!atom)
+				return 1;
+
+			atom->quant = QUANT_STAR;
+			str++;
+		break;
+		case '?':
+			if (!new_atom(self, ATOM_ANY))
+				return 1;
+			str++;
+		break;
+		case '[':
+			str = parse_class(self, str + 1, 1);
+			if (!str)
+				return 1;
+		break;
+		case '\\':
+			if (str[1])
+				str++;
+		/* fallthrough */
+		default:
+			atom = new_atom(self, ATOM_CHAR);
+			if (!atom)
+				return 1;
+
+			atom->c = fold(utf8_next(&str));
+		}
+	}
+
+	return 0;
+}
+
+static int parse_regex(struct sd_pattern *self, const char *str)
+{
+	struct atom *atom = NULL;
+
+	if (*str == '^') {
+		self->anchor_start = 1;
+		str++;
+	}
+
+	while (*str) {
+		switch (*str) {
+		case '$':
+			if (str[1])
+				goto unsupported;
+
+			self->anchor_end = 1;
+			str++;
+		break;
+		case '*':
+		case '+':
+		case '?':
+			if (!atom || atom->quant != QUANT_ONE) {
+				sd_err("Misplaced quantifier '%c' in search pattern", *str);
+				return 1;
+			}
+
+			atom->quant = *str == '*' ? QUANT_STAR :
+			              *str == '+' ? QUANT_PLUS : QUANT_OPT;
+			str++;
+		break;
+		case '.':
+			atom = new_atom(self, ATOM_ANY);
+			if (!atom)
+				return 1;
+			str++;
+		break;
+		case '[':
+			str = parse_class(self, str + 1, 0);
+			if (!str)
+				return 1;
+
+			atom = &self->atoms[self->atom_cnt - 1];
+		break;
+		case '(':
+		case ')':
+		case '|':
+		case '{':
+		case '}':
+		case '^':
+			goto unsupported;
+		case '\\':
+			/* Escapes such as \d or \w are not supported */
+			if (isalnum((unsigned char)str[1])) {
+				sd_err("Unsupported escape '\\%c' in search pattern", str[1]);
+				return 1;
+			}
+
+			if (str[1])
+				str++;
+		/* fallthrough */
+		default:
+			atom = new_atom(self, ATOM_CHAR);
+			if (!atom)
+				return 1;
+
+			atom->c = fold(utf8_next(&str));
+		}
+	}
+
+	return 0;
+unsupported:
+	sd_err("Unsupported '%c' in search pattern", *str);
+	return 1;
+}
+
+/*
+ * Adds the states reachable by skipping optional atoms. An active state in a
+ * run of optional atoms activates the rest of the run and the state after it,
+ * which is what the carry of the addition does.
+ */
+static inline uint64_t closure(const struct sd_pattern *self, uint64_t states)
+{
+	uint64_t skip = self->skip_mask;
+
+	return states | (((states & skip) + skip) ^ skip);
+}
+
+/*
+ * Literal text at the start and at the end of all matches is used to narrow
+ * down the searched range and to reject words cheaply.
+ */
+static void find_literals(struct sd_pattern *self)
+{
+	size_t len = 0, off;
+	unsigned int i;
+
+	for (i = 0; self->anchor_start && i < self->atom_cnt; i++) {
+		struct atom *atom = &self->atoms[i];
+
+		if (atom->type != ATOM_CHAR || atom->quant != QUANT_ONE)
+			break;
+
+		if (len + 4 > SD_SEARCH_PREFIX_MAX)
+			break;
+
+		len += utf8_put(self->prefix + len, atom->c);
+	}
+
+	self->prefix[len] = 0;
+
+	if (!self->anchor_end)
+		return;
+
+	off = SD_SEARCH_PREFIX_MAX;
+
+	for (i = self->atom_cnt; i > 0; i--) {
+		struct atom *atom = &self->atoms[i - 1];
+		char buf[4];
+		size_t clen;
+
+		if (atom->type != ATOM_CHAR || atom->quant != QUANT_ONE)
+			break;
+
+		clen = utf8_put(buf, atom->c);
+		if (clen > off)
+			break;
+
+		off -= clen;
+		memcpy(self->suffix + off, buf, clen);
+	}
+
+	self->suffix_len = SD_SEARCH_PREFIX_MAX - off;
+	memmove(self->suffix, self->suffix + off, self->suffix_len);
+	self->suffix[self->suffix_len] = 0;
+}
+
+static int class_match(const struct sd_pattern *self, const struct atom *atom, uint32_t c)
+{
+	const struct range *range = &self->ranges[atom->c];
+	uint32_t uc = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+	unsigned int i;
+
+	for (i = 0; i < atom->range_cnt; i++) {
+		if ((c >= range[i].min && c <= range[i].max) ||
+		    (uc >= range[i].min && uc <= range[i].max))
+			return !atom->negate;
+	}
+
+	return atom->negate;
+}
+
+static inline int atom_match(const struct sd_pattern *self, const struct atom *atom, uint32_t c)
+{
+	switch (atom->type) {
+	case ATOM_CHAR:
+		return atom->c == c;
+	case ATOM_ANY:
+		return 1;
+	default:
+		return class_match(self, atom, c);
+	}
+}
+
+static uint64_t char_mask(const struct sd_pattern *self, uint32_t c)
+{
+	uint64_t mask = 0;
+	unsigned int i;
+
+	if (c < 128)
+		return self->ascii_masks[c];
+
+	for (i = 0; i < self->atom_cnt; i++) {
+		if (atom_match(self, &self->atoms[i], c))
+			mask |= 1ULL << i;
+	}
+
+	return mask;
+}
+
+struct sd_pattern *sd_pattern_compile(const char *pattern, unsigned int flags)
+{
+	struct sd_pattern *self = calloc(1, sizeof(*self));
+	unsigned int i, c;
+	int ret;
+
+	if (!self) {
+		sd_err("Failed to allocate search pattern");
+		return NULL;
+	}
+
+	if (flags & SD_SEARCH_REGEX)
+		ret = parse_regex(self, pattern);
+	else
+		ret = parse_glob(self, pattern);
+
+	if (ret) {
+		free(self);
+		return NULL;
+	}
+
+	for (i = 0; i < self->atom_cnt; i++) {
+		switch (self->atoms[i].quant) {
+		case QUANT_OPT:
+			self->skip_mask |= 1ULL << i;
+		break;
+		case QUANT_STAR:
+			self->skip_mask |= 1ULL << i;
+			self->loop_mask |= 1ULL << i;
+		break;
+		case QUANT_PLUS:
+			self->loop_mask |= 1ULL << i;
+		break;
+		}
+	}
+
+	self->start = closure(self, 1);
+
+	for (c = 0; c < 128; c++) {
+		for (i = 0; i < self->atom_cnt; i++) {
+			if (atom_match(self, &self->atoms[i], fold(c)))
+				self->ascii_masks[c] |= 1ULL << i;
+		}
+	}
+
+	find_literals(self);
+
+	return self;
+}
+
+const char *sd_pattern_prefix(struct sd_pattern *self)
+{
+	return self->prefix;
+}
+
+static int suffix_match(const struct sd_pattern *self, const char *word)
+{
+	size_t len = strlen(word), i;
+
+	if (len < self->suffix_len)
+		return 0;
+
+	word += len - self->suffix_len;
+
+	for (i = 0; i < self->suffix_len; i++) {
+		if (fold((uint8_t)word[i]) != (uint8_t)self->suffix[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+int sd_pattern_match(const struct sd_pattern *self, const char *word)
+{
+	uint64_t accept = 1ULL << self->atom_cnt;
+	uint64_t states = self->start;
+
+	if (self->suffix_len && !suffix_match(self, word))
+		return 0;
+
+	while (*word) {
+		uint64_t matched;
+
+		if (!self->anchor_end && (states & accept))
+			return 1;
+
+		matched = states & char_mask(self, utf8_next(&word));
+
+		states = closure(self, (matched << 1) | (matched & self->loop_mask));
+
+		if (!self->anchor_start)
+			states |= self->start;
+		else if (!states)
+			return 0;
+	}
+
+	return !!(states & accept);
+}
+
+void sd_pattern_free(struct sd_pattern *self)
+{
+	free(self);
+}
+
+/* Number of words matched by a worker at a time */
+#define SEARCH_BLOCK 8192
+#define SEARCH_THREADS_MAX 64
+/* How many blocks per thread may be matched ahead of the reported ones */
+#define SEARCH_AHEAD 4
+
+struct search_block {
+	unsigned int *idxs;
+	unsigned int cnt;
+	int done;
+};
+
+struct search_ctx {
+	const struct sd_pattern *pat;
+	char **words;
+	unsigned int first;
+	unsigned int cnt;
+	unsigned int block_cnt;
+	unsigned int next;
+	/* blocks below are reported, workers wait if they get too far ahead */
+	unsigned int reported;
+	unsigned int ahead;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct search_block *blocks;
+};
+
+/*
+ * The workers match the blocks in any order and the calling thread reports
+ * the results block by block in the index order. The workers stay a few
+ * blocks ahead of the reported ones so that a search with a limit does not
+ * scan the whole range and the buffered results are bounded.
+ */
+static void *search_thread(void *priv)
+{
+	struct search_ctx *ctx = priv;
+	unsigned int buf[SEARCH_BLOCK];
+	unsigned int b;
+
+	while ((b = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->block_cnt) {
+		unsigned int i, cnt = 0;
+		int stop;
+
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->stop && b >= ctx->reported + ctx->ahead)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		stop = ctx->stop;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (stop)
+			break;
+
+		unsigned int first = ctx->first + b * SEARCH_BLOCK;
+		unsigned int last = MIN(first + SEARCH_BLOCK, ctx->first + ctx->cnt);
+		unsigned int *idxs = NULL;
+
+		for (i = first; i < last; i++) {
+			if (sd_pattern_match(ctx->pat, ctx->words[i]))
+				buf[cnt++] = i;
+		}
+
+		if (cnt) {
+			idxs = malloc(cnt * sizeof(*idxs));
+			if (idxs)
+				memcpy(idxs, buf, cnt * sizeof(*idxs));
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->blocks[b].idxs = idxs;
+		ctx->blocks[b].cnt = cnt;
+		ctx->blocks[b].done = cnt && !idxs ? -1 : 1;
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return NULL;
+}
+
+static int search_serial(const struct sd_pattern *pat, char **words, unsigned int first,
+                         unsigned int cnt, unsigned int limit, sd_search_cb cb, void *priv)
+{
+	unsigned int i, matches = 0;
+
+	for (i = first; i < first + cnt && matches < limit; i++) {
+		if (!sd_pattern_match(pat, words[i]))
+			continue;
+
+		matches++;
+
+		if (cb(i, words[i], priv))
+			break;
+	}
+
+	return matches;
+}
+
+int sd_search_words(const struct sd_pattern *pat, char **words, unsigned int first,
+                    unsigned int cnt, unsigned int limit, unsigned int threads,
+                    sd_search_cb cb, void *priv)
+{
+	struct search_ctx ctx = {
+		.pat = pat,
+		.words = words,
+		.first = first,
+		.cnt = cnt,
+		.block_cnt = (cnt + SEARCH_BLOCK - 1) / SEARCH_BLOCK,
+	};
+	pthread_t tids[SEARCH_THREADS_MAX];
+	unsigned int b, i, matches = 0, threads_cnt;
+	int ret = 0;
+
+	if (!limit)
+		limit = (unsigned int)-1;
+
+	if (!threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	threads = MIN(threads, MIN(ctx.block_cnt, SEARCH_THREADS_MAX));
+
+	if (threads <= 1)
+		return search_serial(pat, words, first, cnt, limit, cb, priv);
+
+	ctx.ahead = threads * SEARCH_AHEAD;
+
+	ctx.blocks = calloc(ctx.block_cnt, sizeof(*ctx.blocks));
+	if (!ctx.blocks) {
+		sd_err("Failed to allocate search blocks");
+		return -1;
+	}
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+
+	for (threads_cnt = 0; threads_cnt < threads; threads_cnt++) {
+		if (pthread_create(&tids[threads_cnt], NULL, search_thread, &ctx))
+			break;
+	}
+
+	/* Falls back to matching in the calling thread */
+	if (!threads_cnt) {
+		ret = search_serial(pat, words, first, cnt, limit, cb, priv);
+		goto exit;
+	}
+
+	for (b = 0; b < ctx.block_cnt; b++) {
+		struct search_block *block = &ctx.blocks[b];
+		int stop = 0;
+
+		pthread_mutex_lock(&ctx.lock);
+		while (!block->done)
+			pthread_cond_wait(&ctx.cond, &ctx.lock);
+		pthread_mutex_unlock(&ctx.lock);
+
+		if (block->done < 0) {
+			sd_err("Failed to allocate search results");
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < block->cnt && !stop; i++) {
+			unsigned int idx = block->idxs[i];
+
+			matches++;
+			stop = cb(idx, words[idx], priv) || matches >= limit;
+		}
+
+		free(block->idxs);
+		block->idxs = NULL;
+
+		if (stop)
+			break;
+
+		pthread_mutex_lock(&ctx.lock);
+		ctx.reported = b + 1;
+		pthread_cond_broadcast(&ctx.cond);
+		pthread_mutex_unlock(&ctx.lock);
+	}
+
+	if (!ret)
+		ret = matches;
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.stop = 1;
+	pthread_cond_broadcast(&ctx.cond);
+	pthread_mutex_unlock(&ctx.lock);
+
+	for (i = 0; i < threads_cnt; i++)
+		pthread_join(tids[i], NULL);
+exit:
+	for (b = 0; b < ctx.block_cnt; b++)
+		free(ctx.blocks[b].idxs);
+
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+	free(ctx.blocks);
+
+	return ret;
+}
@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Decompressed chunk cache shared between processes.
+ *
+ * The cache is a POSIX shared memory segment named after the user id, the
+ * dict.dz file identity, i.e. device, inode, size and mtime, and the chunk
+ * size, so that all processes of a user that open the same dictionary file
+ * attach the same segment while a replaced file ends up in a new one. A
+ * segment with our name that is not owned by us or is accessible by others
+ * is never attached, we fall back to an anonymous mapping instead.
+ *
+ * Segments for older versions of a file, i.e. with the same device and inode
+ * but different size or mtime, are unlinked when a new segment is created.
+ * A segment whose file was removed or modified is unlinked when a process
+ * detaches it. Processes that still have it mapped keep using it.
+ *
+ * The segment is a direct mapped table of slots, a chunk can be stored only
+ * in the slot at chunk index modulo number of slots. Each slot is protected by
+ * a sequence lock, the sequence is odd while the slot is being written.
+ * Readers do not retry, a read that raced with a writer is treated as a miss
+ * and the chunk is inflated by the caller.
+ *
+ * Writers serialize on a per slot lock that holds the pid of the writer.
+ * Writers that find the slot locked skip the insertion, unless the lock
+ * owner does not exist anymore, in which case the lock is taken over and the
+ * slot rewritten, so that a process killed in the middle of a write does not
+ * disable the slot forever. Hence the processes sharing a segment have to
+ * share a pid namespace as well.
+ *
+ * The segment is created once with a fixed size and never resized, since
+ * shrinking a segment other processes have mapped would crash them.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+#define SHM_MAGIC 0x53444349
+
+struct shm_hdr {
+	uint32_t magic;
+	uint32_t chunk_size;
+	uint32_t slot_cnt;
+	uint32_t slot_size;
+};
+
+struct shm_slot {
+	uint32_t seq;
+	/* pid of the writer, zero when unlocked */
+	int32_t lock;
+	/* chunk index + 1, zero for an empty slot */
+	uint32_t idx;
+	char data[];
+};
+
+struct sd_shm_cache {
+	struct shm_hdr *hdr;
+	size_t size;
+	/* segment name, NULL for an anonymous mapping */
+	char *name;
+	/* dict.dz fd and its identity, the fd is not ours */
+	int fd;
+	struct stat st;
+	uint32_t chunk_size;
+	uint32_t slot_cnt;
+	size_t slot_size;
+};
+
+#define SHM_HDR_SIZE 64
+
+static size_t slot_size(uint32_t chunk_size)
+{
+	return (sizeof(struct shm_slot) + chunk_size + 63) & ~(size_t)63;
+}
+
+static struct shm_slot *get_slot(struct sd_shm_cache *self, uint32_t idx)
+{
+	char *slots = (char *)self->hdr + SHM_HDR_SIZE;
+
+	return (struct shm_slot *)(slots + (idx % self->slot_cnt) * self->slot_size);
+}
+
+/*
+ * The segment may be created concurrently by several processes, all of them
+ * compute the same layout and the first one to get there publishes it. The
+ * wait is bounded in a case that the process that started the initialization
+ * was killed.
+ */
+static int init_hdr(struct shm_hdr *hdr, uint32_t chunk_size, uint32_t slot_cnt)
+{
+	uint32_t magic = 0;
+	int i;
+
+	if (__atomic_compare_exchange_n(&hdr->magic, &magic, SHM_MAGIC - 1, 0,
+	                                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		hdr->chunk_size = chunk_size;
+		hdr->slot_cnt = slot_cnt;
+		hdr->slot_size = slot_size(chunk_size);
+		__atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	for (i = 0; magic == SHM_MAGIC - 1 && i < 1000; i++) {
+		usleep(100);
+		magic = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE);
+	}
+
+	if (magic != SHM_MAGIC || hdr->chunk_size != chunk_size ||
+	    hdr->slot_size != slot_size(chunk_size)) {
+		sd_err("Shared chunk cache has invalid header");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens a segment created by another process, the size is set right after
+ * the creation so we may have to wait for it briefly.
+ *
+ * Returns -2 if the segment is not ours, since anybody can create a segment
+ * with a given name.
+ */
+static int open_existing(const char *name, size_t *size)
+{
+	struct stat st;
+	int i, fd;
+
+	fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		if (errno == EACCES)
+			return -2;
+
+		sd_err("Failed to open shared memory '%s': %s", name, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < 100; i++) {
+		if (fstat(fd, &st)) {
+			sd_err("Failed to stat shared memory: %s", strerror(errno));
+			break;
+		}
+
+		if (st.st_uid != geteuid() || (st.st_mode & 077)) {
+			close(fd);
+			return -2;
+		}
+
+		if (st.st_size > SHM_HDR_SIZE) {
+			*size = st.st_size;
+			return fd;
+		}
+
+		usleep(1000);
+	}
+
+	sd_err("Shared memory '%s' was not initialized", name);
+	close(fd);
+	return -1;
+}
+
+/*
+ * Unlinks segments for older versions of the dict.dz file, these share the
+ * prefix with the uid, device and inode.
+ */
+static void unlink_stale(const char *prefix, const char *name)
+{
+	struct dirent *entry;
+	size_t prefix_len = strlen(prefix);
+	char stale[NAME_MAX + 2];
+	DIR *dir;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, prefix, prefix_len))
+			continue;
+
+		/* Our name starts with a slash */
+		if (!strcmp(entry->d_name, name + 1))
+			continue;
+
+		snprintf(stale, sizeof(stale), "/%s", entry->d_name);
+
+		shm_unlink(stale);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Creates or opens the named segment, returns -2 if the segment exists and
+ * is not ours.
+ */
+static int open_segment(const char *prefix, const char *name, size_t *size)
+{
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		if (errno == EEXIST)
+			return open_existing(name, size);
+
+		sd_err("Failed to create shared memory '%s': %s", name, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, *size)) {
+		sd_err("Failed to resize shared memory: %s", strerror(errno));
+		shm_unlink(name);
+		close(fd);
+		return -1;
+	}
+
+	unlink_stale(prefix, name);
+
+	return fd;
+}
+
+struct sd_shm_cache *sd_shm_cache_open(int fd, uint32_t chunk_size, unsigned int slots)
+{
+	struct sd_shm_cache *self;
+	char *prefix, *name;
+	size_t size;
+	void *map;
+	int shm_fd;
+
+	self = malloc(sizeof(*self));
+	if (!self) {
+		sd_err("Failed to allocate shared chunk cache");
+		return NULL;
+	}
+
+	if (fstat(fd, &self->st)) {
+		sd_err("Failed to stat dict.dz: %s", strerror(errno));
+		goto err0;
+	}
+
+	prefix = sd_aprintf("libstardict-%x-%llx-%llx-", (unsigned int)geteuid(),
+	                    (unsigned long long)self->st.st_dev,
+	                    (unsigned long long)self->st.st_ino);
+	if (!prefix)
+		goto err0;
+
+	name = sd_aprintf("/%s%llx-%llx.%lx-%x", prefix,
+	                  (unsigned long long)self->st.st_size,
+	                  (unsigned long long)self->st.st_mtim.tv_sec,
+	                  (long)self->st.st_mtim.tv_nsec, chunk_size);
+	if (!name)
+		goto err1;
+
+	size = SHM_HDR_SIZE + slots * slot_size(chunk_size);
+
+	shm_fd = open_segment(prefix, name, &size);
+	if (shm_fd == -1)
+		goto err2;
+
+	if (shm_fd == -2) {
+		sd_err("Shared memory '%s' is not owned by us, using a private cache", name);
+		free(name);
+		name = NULL;
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	} else {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+		close(shm_fd);
+	}
+
+	if (map == MAP_FAILED) {
+		sd_err("Failed to map shared memory: %s", strerror(errno));
+		goto err2;
+	}
+
+	free(prefix);
+
+	/* The slot count of an existing segment takes precedence */
+	slots = (size - SHM_HDR_SIZE) / slot_size(chunk_size);
+
+	self->hdr = map;
+	self->size = size;
+	self->name = name;
+	self->fd = fd;
+	self->chunk_size = chunk_size;
+	self->slot_cnt = slots;
+	self->slot_size = slot_size(chunk_size);
+
+	if (!slots) {
+		sd_err("Shared chunk cache has no slots");
+		sd_shm_cache_close(self);
+		return NULL;
+	}
+
+	if (init_hdr(self->hdr, chunk_size, slots) || self->hdr->slot_cnt != slots) {
+		sd_shm_cache_close(self);
+		return NULL;
+	}
+
+	return self;
+err2:
+	free(name);
+err1:
+	free(prefix);
+err0:
+	free(self);
+	return NULL;
+}
+
+int sd_shm_cache_has(struct sd_shm_cache *self, uint32_t idx)
+{
+	struct shm_slot *slot = get_slot(self, idx);
+
+	return __atomic_load_n(&slot->idx, __ATOMIC_RELAXED) == idx + 1;
+}
+
+int sd_shm_cache_copy(struct sd_shm_cache *self, uint32_t idx, void *dst,
+                      uint32_t off, uint32_t size)
+{
+	struct shm_slot *slot = get_slot(self, idx);
+	uint32_t seq;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return 1;
+
+	if (__atomic_load_n(&slot->idx, __ATOMIC_RELAXED) != idx + 1)
+		return 1;
+
+	memcpy(dst, slot->data + off, size);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Takes the slot lock, a lock held by a process that does not exist anymore
+ * is taken over.
+ */
+static int slot_lock(struct shm_slot *slot, int32_t pid)
+{
+	int32_t owner = 0;
+
+	if (__atomic_compare_exchange_n(&slot->lock, &owner, pid, 0,
+	                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+
+	if (kill(owner, 0) == 0 || errno != ESRCH)
+		return 1;
+
+	return !__atomic_compare_exchange_n(&slot->lock, &owner, pid, 0,
+	                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void sd_shm_cache_put(struct sd_shm_cache *self, uint32_t idx, const void *data)
+{
+	struct shm_slot *slot = get_slot(self, idx);
+	uint32_t seq;
+
+	/*
+	 * The chunk is already cached unless the slot was left locked by a
+	 * writer killed after it has set the index, such slot is rewritten.
+	 */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (!(seq & 1) && __atomic_load_n(&slot->idx, __ATOMIC_RELAXED) == idx + 1)
+		return;
+
+	if (slot_lock(slot, getpid()))
+		return;
+
+	/*
+	 * The sequence is still odd if the previous owner of the lock was
+	 * killed in the middle of a write.
+	 */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if (!(seq & 1))
+		__atomic_store_n(&slot->seq, ++seq, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&slot->idx, idx + 1, __ATOMIC_RELAXED);
+	memcpy(slot->data, data, self->chunk_size);
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+}
+
+size_t sd_shm_cache_size(struct sd_shm_cache *self)
+{
+	return self->size;
+}
+
+/*
+ * The segment is stale once the dict.dz file was removed, replaced by a
+ * rename or modified in place, nobody would attach it again.
+ */
+static int is_stale(struct sd_shm_cache *self)
+{
+	struct stat st;
+
+	if (fstat(self->fd, &st))
+		return 0;
+
+	return !st.st_nlink || st.st_size != self->st.st_size ||
+	       st.st_mtim.tv_sec != self->st.st_mtim.tv_sec ||
+	       st.st_mtim.tv_nsec != self->st.st_mtim.tv_nsec;
+}
+
+void sd_shm_cache_close(struct sd_shm_cache *self)
+{
+	if (!self)
+		return;
+
+	if (self->name && is_stale(self))
+		shm_unlink(self->name);
+
+	munmap(self->hdr, self->size);
+	free(self->name);
+	free(self);
+}
@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Markup to plain text conversion.
+ *
+ * The text between tags and entities is skipped in blocks, the next '<' or
+ * '&' is searched for with SSE2 or AVX2 if available.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# define SD_STRIP_X86
+# include <immintrin.h>
+#endif
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+#define SD_INLINE static inline __attribute__ ((always_inline))
+
+SD_INLINE const char *find_special_scalar(const char *str, const char *end)
+{
+	for (; str < end; str++) {
+		switch (*str) {
+		case 0:
+		case '<':
+		case '&':
+			return str;
+		}
+	}
+
+	return end;
+}
+
+#ifdef SD_STRIP_X86
+
+/*
+ * Only whole blocks inside of the string are loaded, the tail shorter than a
+ * block is searched by the scalar loop.
+ */
+__attribute__ ((target ("sse2")))
+SD_INLINE unsigned int special_mask_sse2(const void *block)
+{
+	__m128i v = _mm_loadu_si128(block);
+	__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+	                         _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+	return _mm_movemask_epi8(m);
+}
+
+__attribute__ ((target ("sse2")))
+SD_INLINE const char *find_special_sse2(const char *str, const char *end)
+{
+	unsigned int mask;
+
+	for (; end - str >= 16; str += 16) {
+		mask = special_mask_sse2(str);
+		if (mask)
+			return str + __builtin_ctz(mask);
+	}
+
+	return find_special_scalar(str, end);
+}
+
+__attribute__ ((target ("avx2")))
+SD_INLINE uint32_t special_mask_avx2(const void *block)
+{
+	__m256i v = _mm256_loadu_si256(block);
+	__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+	                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+
+	return _mm256_movemask_epi8(m);
+}
+
+__attribute__ ((target ("avx2")))
+SD_INLINE const char *find_special_avx2(const char *str, const char *end)
+{
+	uint32_t mask;
+
+	for (; end - str >= 32; str += 32) {
+		mask = special_mask_avx2(str);
+		if (mask)
+			return str + __builtin_ctz(mask);
+	}
+
+	return find_special_scalar(str, end);
+}
+
+#endif /* SD_STRIP_X86 */
+
+enum tag_type {
+	TAG_OTHER,
+	/* starts a new line */
+	TAG_BLOCK,
+	/* line breaks are always kept */
+	TAG_BREAK,
+};
+
+#define TAG_MAX 10
+
+static int is_alnum(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+#define TAG2(a, b) ((a) << 8 | (b))
+
+static enum tag_type tag_type(const char *name)
+{
+	char buf[TAG_MAX];
+	unsigned int len = 0;
+
+	while (is_alnum(name[len])) {
+		if (len >= TAG_MAX)
+			return TAG_OTHER;
+
+		buf[len] = name[len] | 0x20;
+		len++;
+	}
+
+	switch (len) {
+	case 1:
+		return buf[0] == 'p' ? TAG_BLOCK : TAG_OTHER;
+	case 2:
+		switch (TAG2(buf[0], buf[1])) {
+		case TAG2('b', 'r'):
+		case TAG2('h', 'r'):
+			return TAG_BREAK;
+		case TAG2('d', 'd'):
+		case TAG2('d', 'l'):
+		case TAG2('d', 't'):
+		case TAG2('h', '1'):
+		case TAG2('h', '2'):
+		case TAG2('h', '3'):
+		case TAG2('h', '4'):
+		case TAG2('h', '5'):
+		case TAG2('h', '6'):
+		case TAG2('l', 'i'):
+		case TAG2('o', 'l'):
+		case TAG2('t', 'r'):
+		case TAG2('u', 'l'):
+			return TAG_BLOCK;
+		}
+	break;
+	case 3:
+		if (!memcmp(buf, "div", 3) || !memcmp(buf, "pre", 3))
+			return TAG_BLOCK;
+	break;
+	case 5:
+		if (!memcmp(buf, "table", 5))
+			return TAG_BLOCK;
+	break;
+	case 7:
+		if (!memcmp(buf, "address", 7))
+			return TAG_BLOCK;
+	break;
+	case 10:
+		if (!memcmp(buf, "blockquote", 10))
+			return TAG_BLOCK;
+	break;
+	}
+
+	return TAG_OTHER;
+}
+
+/*
+ * Skips a tag, returns a pointer after the tag end or NULL if the tag is not
+ * terminated.
+ */
+static const char *strip_tag(const char *tag, const char *start, char **out)
+{
+	const char *name = tag + 1;
+	const char *end;
+
+	if (name[0] == '!' && name[1] == '-' && name[2] == '-') {
+		end = strstr(name + 3, "-->");
+		return end ? end + 3 : NULL;
+	}
+
+	for (end = name; *end != '>'; end++) {
+		if (!*end)
+			return NULL;
+	}
+
+	if (*name == '/')
+		name++;
+
+	switch (tag_type(name)) {
+	case TAG_OTHER:
+	break;
+	case TAG_BLOCK:
+		/* Block tags do not add empty lines */
+		if (*out > start && (*out)[-1] != '\n')
+			*((*out)++) = '\n';
+	break;
+	case TAG_BREAK:
+		*((*out)++) = '\n';
+	break;
+	}
+
+	return end + 1;
+}
+
+struct entity {
+	const char *name;
+	unsigned int len;
+	uint32_t code;
+};
+
+#define ENTITY(name, code) {name, sizeof(name) - 1, code}
+
+static const struct entity entities[] = {
+	ENTITY("amp", '&'),
+	ENTITY("lt", '<'),
+	ENTITY("gt", '>'),
+	ENTITY("quot", '"'),
+	ENTITY("apos", '\''),
+	ENTITY("nbsp", 0xa0),
+	ENTITY("sect", 0xa7),
+	ENTITY("copy", 0xa9),
+	ENTITY("laquo", 0xab),
+	ENTITY("shy", 0xad),
+	ENTITY("reg", 0xae),
+	ENTITY("deg", 0xb0),
+	ENTITY("plusmn", 0xb1),
+	ENTITY("para", 0xb6),
+	ENTITY("middot", 0xb7),
+	ENTITY("raquo", 0xbb),
+	ENTITY("times", 0xd7),
+	ENTITY("divide", 0xf7),
+	ENTITY("ndash", 0x2013),
+	ENTITY("mdash", 0x2014),
+	ENTITY("lsquo", 0x2018),
+	ENTITY("rsquo", 0x2019),
+	ENTITY("ldquo", 0x201c),
+	ENTITY("rdquo", 0x201d),
+	ENTITY("bull", 0x2022),
+	ENTITY("hellip", 0x2026),
+	ENTITY("euro", 0x20ac),
+	ENTITY("trade", 0x2122),
+	{}
+};
+
+#define ENTITY_MAX 32
+
+static unsigned int utf8_encode(uint32_t code, char *buf)
+{
+	if (!code || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+		code = 0xfffd;
+
+	if (code < 0x80) {
+		buf[0] = code;
+		return 1;
+	}
+
+	if (code < 0x800) {
+		buf[0] = 0xc0 | (code >> 6);
+		buf[1] = 0x80 | (code & 0x3f);
+		return 2;
+	}
+
+	if (code < 0x10000) {
+		buf[0] = 0xe0 | (code >> 12);
+		buf[1] = 0x80 | ((code >> 6) & 0x3f);
+		buf[2] = 0x80 | (code & 0x3f);
+		return 3;
+	}
+
+	buf[0] = 0xf0 | (code >> 18);
+	buf[1] = 0x80 | ((code >> 12) & 0x3f);
+	buf[2] = 0x80 | ((code >> 6) & 0x3f);
+	buf[3] = 0x80 | (code & 0x3f);
+	return 4;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	c |= 0x20;
+
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+static int parse_numeric_entity(const char *str, size_t len, uint32_t *code)
+{
+	unsigned int base = 10;
+	uint32_t val = 0;
+	size_t i;
+	int d;
+
+	if (*str == 'x' || *str == 'X') {
+		base = 16;
+		str++;
+		len--;
+	}
+
+	if (!len)
+		return 1;
+
+	for (i = 0; i < len; i++) {
+		d = hex_digit(str[i]);
+		if (d < 0 || d >= (int)base)
+			return 1;
+
+		/* Saturate, out of range values are replaced anyway */
+		if (val <= 0x10ffff)
+			val = val * base + d;
+	}
+
+	*code = val;
+
+	return 0;
+}
+
+static int parse_named_entity(const char *str, size_t len, uint32_t *code)
+{
+	unsigned int i;
+
+	for (i = 0; entities[i].name; i++) {
+		if (entities[i].len == len && entities[i].name[0] == str[0] &&
+		    !memcmp(str, entities[i].name, len)) {
+			*code = entities[i].code;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Decodes an entity, unknown entities are passed through. The UTF-8 encoding
+ * is never longer than the entity so the data can be decoded in place.
+ */
+static const char *decode_entity(const char *amp, char **out)
+{
+	const char *name = amp + 1;
+	const char *end = name;
+	unsigned int i, len;
+	char buf[4];
+	uint32_t code;
+	int ret;
+
+	while (end - name < ENTITY_MAX && *end && *end != ';')
+		end++;
+
+	if (*end != ';' || end == name)
+		goto pass;
+
+	if (*name == '#')
+		ret = parse_numeric_entity(name + 1, end - name - 1, &code);
+	else
+		ret = parse_named_entity(name, end - name, &code);
+
+	if (ret)
+		goto pass;
+
+	len = utf8_encode(code, buf);
+
+	for (i = 0; i < len; i++)
+		*((*out)++) = buf[i];
+
+	return end + 1;
+pass:
+	*((*out)++) = '&';
+	return name;
+}
+
+/*
+ * The loop is instantiated for each instruction set so that the search for
+ * the next special character is inlined.
+ */
+SD_INLINE size_t strip_markup(char *str, size_t size,
+                              const char *(*find_special)(const char *str, const char *end))
+{
+	const char *end = str + size;
+	const char *i = str;
+	char *c = str;
+	size_t len;
+
+	for (;;) {
+		const char *special = find_special(i, end);
+
+		len = special - i;
+		if (c != i)
+			memmove(c, i, len);
+
+		c += len;
+		i = special;
+
+		switch (*i) {
+		case 0:
+			goto exit;
+		case '<':
+			i = strip_tag(i, str, &c);
+			if (!i)
+				goto exit;
+		break;
+		case '&':
+			i = decode_entity(i, &c);
+		break;
+		}
+	}
+
+exit:
+	*c = 0;
+
+	return c - str;
+}
+
+static size_t strip_markup_scalar(char *str, size_t size)
+{
+	return strip_markup(str, size, find_special_scalar);
+}
+
+#ifdef SD_STRIP_X86
+__attribute__ ((target ("sse2")))
+static size_t strip_markup_sse2(char *str, size_t size)
+{
+	return strip_markup(str, size, find_special_sse2);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t strip_markup_avx2(char *str, size_t size)
+{
+	return strip_markup(str, size, find_special_avx2);
+}
+#endif
+
+typedef size_t (*strip_markup_fn)(char *str, size_t size);
+
+static strip_markup_fn strip_markup_impl;
+
+/*
+ * The implementation can be forced by LIBSTARDICT_STRIP=scalar|sse2|avx2
+ * environment variable, which is useful for benchmarking.
+ */
+static strip_markup_fn strip_markup_select(void)
+{
+	const char *force = getenv("LIBSTARDICT_STRIP");
+
+	if (force && !strcmp(force, "scalar"))
+		return strip_markup_scalar;
+
+#ifdef SD_STRIP_X86
+	__builtin_cpu_init();
+
+	if (force && !strcmp(force, "sse2") && __builtin_cpu_supports("sse2"))
+		return strip_markup_sse2;
+
+	if (__builtin_cpu_supports("avx2"))
+		return strip_markup_avx2;
+
+	if (__builtin_cpu_supports("sse2"))
+		return strip_markup_sse2;
+#endif
+
+	return strip_markup_scalar;
+}
+
+static strip_markup_fn strip_markup_get(void)
+{
+	strip_markup_fn fn = __atomic_load_n(&strip_markup_impl, __ATOMIC_RELAXED);
+
+	if (!fn) {
+		fn = strip_markup_select();
+		__atomic_store_n(&strip_markup_impl, fn, __ATOMIC_RELAXED);
+	}
+
+	return fn;
+}
+
+size_t sd_strip_markup(char *str, size_t size)
+{
+	return strip_markup_get()(str, size);
+}
+
+const char *sd_strip_impl(void)
+{
+	strip_markup_fn fn = strip_markup_get();
+
+#ifdef SD_STRIP_X86
+	if (fn == strip_markup_avx2)
+		return "avx2";
+
+	if (fn == strip_markup_sse2)
+		return "sse2";
+#endif
+	(void) fn;
+
+	return "scalar";
+}
@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+unsigned int sd_trace_flags;
+
+/*
+ * The callback and its priv are published as a single pointer to an immutable
+ * pair, so that a trace point never mixes a callback with a priv of another
+ * one. A trace point may still use a pair after it was replaced, hence the
+ * pairs are never freed, a pair that is set again is reused instead.
+ */
+struct trace_cb {
+	sd_trace_cb cb;
+	void *priv;
+	struct trace_cb *next;
+};
+
+static struct trace_cb *trace_cb;
+static struct trace_cb *trace_cbs;
+static pthread_mutex_t trace_cbs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Open is not tied to a dictionary that would have existed before */
+static struct sd_hist open_hist;
+
+static struct trace_cb *trace_cb_get(sd_trace_cb cb, void *priv)
+{
+	struct trace_cb *pair;
+
+	pthread_mutex_lock(&trace_cbs_lock);
+
+	for (pair = trace_cbs; pair; pair = pair->next) {
+		if (pair->cb == cb && pair->priv == priv)
+			goto exit;
+	}
+
+	pair = malloc(sizeof(*pair));
+	if (!pair) {
+		sd_err("Failed to allocate trace callback");
+		goto exit;
+	}
+
+	pair->cb = cb;
+	pair->priv = priv;
+	pair->next = trace_cbs;
+	trace_cbs = pair;
+exit:
+	pthread_mutex_unlock(&trace_cbs_lock);
+	return pair;
+}
+
+/*
+ * The trace points read the flags first and the new flags are published last.
+ */
+void sd_set_trace(unsigned int flags, sd_trace_cb cb, void *priv)
+{
+	struct trace_cb *pair = cb ? trace_cb_get(cb, priv) : NULL;
+
+	__atomic_store_n(&trace_cb, pair, __ATOMIC_RELEASE);
+
+	if (!pair)
+		flags &= ~SD_TRACE_CB;
+
+	__atomic_store_n(&sd_trace_flags, flags, __ATOMIC_RELEASE);
+}
+
+uint64_t sd_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+	if (!ns)
+		return 0;
+
+	return 63 - __builtin_clzll(ns);
+}
+
+/*
+ * Trace points may be hit from multiple threads, see sd_get_entry().
+ */
+static void hist_add(struct sd_hist *hist, uint64_t ns)
+{
+	uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hist->cnt, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+
+	while (ns > max) {
+		if (__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1,
+		                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	__atomic_fetch_add(&hist->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+static struct sd_hist *dict_hist(struct sd_dict *dict)
+{
+	struct sd_hist *hist = __atomic_load_n(&dict->hist, __ATOMIC_ACQUIRE);
+	struct sd_hist *old = NULL;
+
+	if (hist)
+		return hist;
+
+	hist = calloc(SD_TRACE_CNT, sizeof(struct sd_hist));
+	if (!hist)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&dict->hist, &old, hist, 0,
+	                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(hist);
+		return old;
+	}
+
+	return hist;
+}
+
+void sd_trace_end(struct sd_dict *dict, enum sd_trace_point point,
+                  uint64_t start, uint64_t arg)
+{
+	unsigned int flags = __atomic_load_n(&sd_trace_flags, __ATOMIC_ACQUIRE);
+	uint64_t ns = sd_now_ns() - start;
+
+	if ((flags & SD_TRACE_HIST) && point == SD_TRACE_OPEN) {
+		hist_add(&open_hist, ns);
+	} else if (flags & SD_TRACE_HIST) {
+		struct sd_hist *hist = dict_hist(dict);
+
+		if (hist)
+			hist_add(&hist[point], ns);
+	}
+
+	if (flags & SD_TRACE_CB) {
+		struct trace_cb *pair = __atomic_load_n(&trace_cb, __ATOMIC_ACQUIRE);
+
+		if (pair)
+			pair->cb(dict, point, ns, arg, pair->priv);
+	}
+}
+
+static void hist_copy(struct sd_hist *dst, struct sd_hist *src)
+{
+	unsigned int i;
+
+	dst->cnt = __atomic_load_n(&src->cnt, __ATOMIC_RELAXED);
+	dst->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+	dst->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+
+	for (i = 0; i < SD_HIST_BUCKETS; i++)
+		dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+static void hist_reset(struct sd_hist *hist)
+{
+	unsigned int i;
+
+	__atomic_store_n(&hist->cnt, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->max_ns, 0, __ATOMIC_RELAXED);
+
+	for (i = 0; i < SD_HIST_BUCKETS; i++)
+		__atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+}
+
+int sd_get_hist(struct sd_dict *self, enum sd_trace_point point, struct sd_hist *hist)
+{
+	struct sd_hist *dict_hists = self ? __atomic_load_n(&self->hist, __ATOMIC_ACQUIRE) : NULL;
+
+	if (point >= SD_TRACE_CNT)
+		return 1;
+
+	if (point == SD_TRACE_OPEN) {
+		hist_copy(hist, &open_hist);
+		return !hist->cnt;
+	}
+
+	if (!dict_hists) {
+		memset(hist, 0, sizeof(*hist));
+		return 1;
+	}
+
+	hist_copy(hist, &dict_hists[point]);
+
+	return 0;
+}
+
+void sd_reset_hist(struct sd_dict *self)
+{
+	struct sd_hist *dict_hists;
+	unsigned int i;
+
+	if (!self) {
+		hist_reset(&open_hist);
+		return;
+	}
+
+	dict_hists = __atomic_load_n(&self->hist, __ATOMIC_ACQUIRE);
+	if (!dict_hists)
+		return;
+
+	for (i = 0; i < SD_TRACE_CNT; i++)
+		hist_reset(&dict_hists[i]);
+}
+
+uint64_t sd_hist_percentile(const struct sd_hist *hist, double percentile)
+{
+	uint64_t sum = 0, limit = hist->cnt * percentile / 100;
+	unsigned int i;
+
+	if (!hist->cnt)
+		return 0;
+
+	for (i = 0; i < SD_HIST_BUCKETS; i++) {
+		sum += hist->buckets[i];
+
+		if (sum > limit)
+			return MIN(hist->max_ns, (uint64_t)2 << i);
+	}
+
+	return hist->max_ns;
+}
+
+static const char *trace_point_names[SD_TRACE_CNT] = {
+	[SD_TRACE_OPEN] = "open",
+	[SD_TRACE_LOOKUP] = "lookup",
+	[SD_TRACE_GET_ENTRY] = "get_entry",
+	[SD_TRACE_IDX_SEARCH] = "idx_search",
+	[SD_TRACE_PREAD] = "pread",
+	[SD_TRACE_INFLATE] = "inflate",
+	[SD_TRACE_MEMCPY] = "memcpy",
+};
+
+const char *sd_trace_point_name(enum sd_trace_point point)
+{
+	if (point >= SD_TRACE_CNT)
+		return "invalid";
+
+	return trace_point_names[point];
+}
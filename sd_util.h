@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+/*
+ * Helper macros shared between the library and the tools.
+ *
+ * This header is not installed.
+ */
+
+#ifndef SD_UTIL_H__
+#define SD_UTIL_H__
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#endif /* SD_UTIL_H__ */
@@ -0,0 +1,627 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+
+    Copyright (C) 2022-2026 Cyril Hrubis <metan@ucw.cz>
+
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "libstardict.h"
+#include "libstardict_priv.h"
+
+/*
+ * The gzip extra field length, stored in 16 bits, includes the chunk sizes
+ * table, which limits the number of chunks.
+ */
+#define MAX_CHUNK_CNT ((UINT16_MAX - EXTRA_HEADER_SIZE + 2) / 2)
+
+struct sd_writer_word {
+	char *word;
+	uint32_t data_offset;
+	uint32_t data_size;
+};
+
+struct sd_writer {
+	char *path;
+	char *name;
+	char book_name[SD_DICT_BOOKNAME_MAX];
+	char entry_fmt;
+
+	int gzip_idx;
+	int err;
+
+	/* words collected so far, sorted on close */
+	struct sd_writer_word *words;
+	unsigned int words_cnt;
+	unsigned int words_size;
+	uint32_t idx_size;
+
+	/* dictzip state */
+	z_stream stream;
+	FILE *chunks;
+	uint16_t chunk_size;
+	uint8_t *chunk;
+	uint8_t *out;
+	size_t out_size;
+	uint16_t chunk_used;
+	uint16_t *chunk_sizes;
+	unsigned int chunk_cnt;
+	unsigned int chunk_sizes_size;
+	uint64_t data_size;
+	uLong crc;
+};
+
+struct sd_writer *sd_writer_open(const char *path, const char *name,
+                                 const char *book_name, char entry_fmt)
+{
+	struct sd_writer *self;
+
+	if (!book_name[0] || strlen(book_name) >= SD_DICT_BOOKNAME_MAX) {
+		sd_err("Invalid book name '%s'", book_name);
+		return NULL;
+	}
+
+	if (strchr(book_name, '\n')) {
+		sd_err("Book name must not contain newlines");
+		return NULL;
+	}
+
+	self = malloc(sizeof(struct sd_writer));
+	if (!self) {
+		sd_err("Failed to allocate writer");
+		return NULL;
+	}
+
+	memset(self, 0, sizeof(*self));
+
+	self->path = strdup(path);
+	self->name = strdup(name);
+	strcpy(self->book_name, book_name);
+	self->entry_fmt = entry_fmt;
+	self->chunk_size = DICT_DZ_CHUNK_MAX;
+	self->crc = crc32(0, NULL, 0);
+
+	if (!self->path || !self->name) {
+		sd_err("Failed to allocate writer");
+		goto err0;
+	}
+
+	self->chunks = tmpfile();
+	if (!self->chunks) {
+		sd_err("Failed to create temporary file: %s", strerror(errno));
+		goto err0;
+	}
+
+	if (deflateInit2(&self->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+	                 -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+		sd_err("Failed to initialize deflate %s", self->stream.msg);
+		goto err1;
+	}
+
+	return self;
+err1:
+	fclose(self->chunks);
+err0:
+	free(self->path);
+	free(self->name);
+	free(self);
+	return NULL;
+}
+
+int sd_writer_set_chunk_size(struct sd_writer *self, unsigned int chunk_size)
+{
+	if (self->chunk) {
+		sd_err("Chunk size must be set before adding data");
+		return 1;
+	}
+
+	if (!chunk_size || chunk_size > DICT_DZ_CHUNK_MAX) {
+		sd_err("Invalid chunk size %u (max %u)", chunk_size, DICT_DZ_CHUNK_MAX);
+		return 1;
+	}
+
+	self->chunk_size = chunk_size;
+
+	return 0;
+}
+
+void sd_writer_set_gzip_idx(struct sd_writer *self, int gzip_idx)
+{
+	self->gzip_idx = gzip_idx;
+}
+
+static int write_deflated(struct sd_writer *self, int flush, size_t *written)
+{
+	int ret;
+
+	*written = 0;
+
+	do {
+		self->stream.next_out = self->out;
+		self->stream.avail_out = self->out_size;
+
+		ret = deflate(&self->stream, flush);
+		if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+			sd_err("Failed to deflate chunk %s", self->stream.msg);
+			return 1;
+		}
+
+		size_t len = self->out_size - self->stream.avail_out;
+
+		if (fwrite(self->out, len, 1, self->chunks) != 1 && len) {
+			sd_err("Failed to write compressed data: %s", strerror(errno));
+			return 1;
+		}
+
+		*written += len;
+	} while (!self->stream.avail_out);
+
+	return 0;
+}
+
+static int flush_chunk(struct sd_writer *self)
+{
+	size_t size;
+
+	if (self->chunk_cnt >= MAX_CHUNK_CNT) {
+		sd_err("Chunk size %u too small for this much data", self->chunk_size);
+		return 1;
+	}
+
+	if (self->chunk_cnt >= self->chunk_sizes_size) {
+		unsigned int new_size = self->chunk_sizes_size ? 2 * self->chunk_sizes_size : 64;
+		uint16_t *sizes = realloc(self->chunk_sizes, new_size * sizeof(uint16_t));
+
+		if (!sizes) {
+			sd_err("Failed to allocate chunk table");
+			return 1;
+		}
+
+		self->chunk_sizes = sizes;
+		self->chunk_sizes_size = new_size;
+	}
+
+	self->stream.next_in = self->chunk;
+	self->stream.avail_in = self->chunk_used;
+
+	/* Full flush resets the compressor state so that chunks can be inflated separately */
+	if (write_deflated(self, Z_FULL_FLUSH, &size))
+		return 1;
+
+	if (size > UINT16_MAX) {
+		sd_err("Compressed chunk too large");
+		return 1;
+	}
+
+	self->chunk_sizes[self->chunk_cnt++] = size;
+	self->chunk_used = 0;
+
+	return 0;
+}
+
+static int alloc_buffers(struct sd_writer *self)
+{
+	if (self->chunk)
+		return 0;
+
+	self->out_size = deflateBound(&self->stream, self->chunk_size) + 16;
+	self->chunk = malloc(self->chunk_size);
+	self->out = malloc(self->out_size);
+
+	if (!self->chunk || !self->out) {
+		sd_err("Failed to allocate chunk buffers");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int add_data(struct sd_writer *self, const uint8_t *data, uint32_t size)
+{
+	if (alloc_buffers(self))
+		return 1;
+
+	if (!size)
+		return 0;
+
+	self->crc = crc32(self->crc, data, size);
+	self->data_size += size;
+
+	while (size) {
+		uint32_t len = MIN(size, (uint32_t)(self->chunk_size - self->chunk_used));
+
+		memcpy(self->chunk + self->chunk_used, data, len);
+		self->chunk_used += len;
+		data += len;
+		size -= len;
+
+		if (self->chunk_used == self->chunk_size && flush_chunk(self))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int add_word(struct sd_writer *self, const char *word,
+                    uint32_t data_offset, uint32_t data_size)
+{
+	size_t word_len = strlen(word);
+
+	if (!word_len || word_len >= 256) {
+		sd_err("Invalid headword length %zu", word_len);
+		return 1;
+	}
+
+	if ((uint64_t)self->idx_size + word_len + 9 > UINT32_MAX) {
+		sd_err("Dictionary too large");
+		return 1;
+	}
+
+	if (self->words_cnt >= self->words_size) {
+		unsigned int new_size = self->words_size ? 2 * self->words_size : 1024;
+		struct sd_writer_word *words = realloc(self->words, new_size * sizeof(*words));
+
+		if (!words) {
+			sd_err("Failed to allocate word list");
+			return 1;
+		}
+
+		self->words = words;
+		self->words_size = new_size;
+	}
+
+	struct sd_writer_word *w = &self->words[self->words_cnt];
+
+	w->word = strdup(word);
+	if (!w->word) {
+		sd_err("Failed to allocate word");
+		return 1;
+	}
+
+	w->data_offset = data_offset;
+	w->data_size = data_size;
+
+	self->words_cnt++;
+	self->idx_size += word_len + 9;
+
+	return 0;
+}
+
+int sd_writer_add(struct sd_writer *self, const char *word,
+                  const void *data, uint32_t data_size)
+{
+	if (self->err)
+		return 1;
+
+	if (self->data_size + data_size > UINT32_MAX) {
+		sd_err("Dictionary too large");
+		goto err;
+	}
+
+	if (add_word(self, word, self->data_size, data_size))
+		goto err;
+
+	if (add_data(self, data, data_size))
+		goto err;
+
+	return 0;
+err:
+	self->err = 1;
+	return 1;
+}
+
+int sd_writer_add_alias(struct sd_writer *self, const char *word)
+{
+	struct sd_writer_word *last;
+
+	if (self->err)
+		return 1;
+
+	if (!self->words_cnt) {
+		sd_err("No entry to alias");
+		goto err;
+	}
+
+	last = &self->words[self->words_cnt - 1];
+
+	if (add_word(self, word, last->data_offset, last->data_size))
+		goto err;
+
+	return 0;
+err:
+	self->err = 1;
+	return 1;
+}
+
+/*
+ * Index has to be sorted in the order the lookup expects it, i.e. case
+ * insensitive comparsion and case sensitive one for words that only differ in
+ * case.
+ */
+static int word_cmp(const void *a, const void *b)
+{
+	const struct sd_writer_word *wa = a;
+	const struct sd_writer_word *wb = b;
+	int ret = strcasecmp(wa->word, wb->word);
+
+	if (ret)
+		return ret;
+
+	return strcmp(wa->word, wb->word);
+}
+
+static void put_u16(uint8_t *buf, uint16_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = val >> 8;
+}
+
+static void put_u32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = val >> 24;
+}
+
+static void put_be32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = (val >> 16) & 0xff;
+	buf[2] = (val >> 8) & 0xff;
+	buf[3] = val & 0xff;
+}
+
+static int write_dict_dz(struct sd_writer *self)
+{
+	size_t trailer_size, header_size;
+	uint8_t *header, buf[4096];
+	unsigned int i;
+	size_t len;
+	FILE *f;
+	int ret = 1;
+
+	if (alloc_buffers(self))
+		return 1;
+
+	if (self->chunk_used && flush_chunk(self))
+		return 1;
+
+	/* Finish the stream with an empty final block outside of the chunks */
+	self->stream.next_in = NULL;
+	self->stream.avail_in = 0;
+
+	long chunks_size = ftell(self->chunks);
+
+	if (write_deflated(self, Z_FINISH, &trailer_size))
+		return 1;
+
+	if (fflush(self->chunks) || ferror(self->chunks)) {
+		sd_err("Failed to write compressed data");
+		return 1;
+	}
+
+	if (EXTRA_HEADER_SIZE - 2 + 2 * self->chunk_cnt > UINT16_MAX) {
+		sd_err("Too many chunks %u for dict.dz header", self->chunk_cnt);
+		return 1;
+	}
+
+	header_size = HEADER_SIZE + 2 * self->chunk_cnt;
+	header = malloc(header_size);
+	if (!header) {
+		sd_err("Failed to allocate dict.dz header");
+		return 1;
+	}
+
+	header[0] = GZ_MAGIC1;
+	header[1] = GZ_MAGIC2;
+	header[2] = GZ_METHOD_DEFLATE;
+	header[3] = GZ_FLAGS_EXTRA_FIELD;
+	put_u32(header + 4, time(NULL));
+	header[8] = 2;
+	header[9] = GZ_OS_UNIX;
+	put_u16(header + 10, EXTRA_HEADER_SIZE - 2 + 2 * self->chunk_cnt);
+	header[12] = DICT_DZ_MAGIC1;
+	header[13] = DICT_DZ_MAGIC2;
+	put_u16(header + 14, EXTRA_HEADER_SIZE - 6 + 2 * self->chunk_cnt);
+	put_u16(header + 16, DICT_DZ_VERSION);
+	put_u16(header + 18, self->chunk_size);
+	put_u16(header + 20, self->chunk_cnt);
+
+	for (i = 0; i < self->chunk_cnt; i++)
+		put_u16(header + HEADER_SIZE + 2 * i, self->chunk_sizes[i]);
+
+	char *dict_path = sd_aprintf("%s/%s.dict.dz", self->path, self->name);
+	if (!dict_path) {
+		sd_err("Failed to allocate path");
+		goto err0;
+	}
+
+	f = fopen(dict_path, "wb");
+	if (!f) {
+		sd_err("Failed to open '%s': %s", dict_path, strerror(errno));
+		goto err1;
+	}
+
+	fwrite(header, header_size, 1, f);
+
+	rewind(self->chunks);
+
+	while ((len = fread(buf, 1, sizeof(buf), self->chunks)))
+		fwrite(buf, len, 1, f);
+
+	if (ftell(f) != (long)header_size + chunks_size + (long)trailer_size) {
+		sd_err("Failed to copy compressed data");
+		fclose(f);
+		goto err1;
+	}
+
+	put_u32(buf, self->crc);
+	put_u32(buf + 4, self->data_size);
+	fwrite(buf, 8, 1, f);
+
+	if (fclose(f)) {
+		sd_err("Failed to write '%s': %s", dict_path, strerror(errno));
+		goto err1;
+	}
+
+	ret = 0;
+err1:
+	free(dict_path);
+err0:
+	free(header);
+	return ret;
+}
+
+static int write_idx(struct sd_writer *self)
+{
+	char *idx_path;
+	unsigned int i;
+	int ret = 1;
+	gzFile gz = NULL;
+	FILE *f = NULL;
+
+	qsort(self->words, self->words_cnt, sizeof(*self->words), word_cmp);
+
+	if (self->gzip_idx) {
+		idx_path = sd_aprintf("%s/%s.idx.gz", self->path, self->name);
+		if (idx_path)
+			gz = gzopen(idx_path, "wb9");
+	} else {
+		idx_path = sd_aprintf("%s/%s.idx", self->path, self->name);
+		if (idx_path)
+			f = fopen(idx_path, "wb");
+	}
+
+	if (!idx_path) {
+		sd_err("Failed to allocate path");
+		return 1;
+	}
+
+	if (!gz && !f) {
+		sd_err("Failed to open '%s'", idx_path);
+		goto err0;
+	}
+
+	for (i = 0; i < self->words_cnt; i++) {
+		struct sd_writer_word *w = &self->words[i];
+		size_t len = strlen(w->word) + 1;
+		uint8_t trailer[8];
+
+		put_be32(trailer, w->data_offset);
+		put_be32(trailer + 4, w->data_size);
+
+		if (gz) {
+			if (gzwrite(gz, w->word, len) != (int)len ||
+			    gzwrite(gz, trailer, 8) != 8)
+				goto err1;
+		} else {
+			if (fwrite(w->word, len, 1, f) != 1 ||
+			    fwrite(trailer, 8, 1, f) != 1)
+				goto err1;
+		}
+	}
+
+	ret = 0;
+err1:
+	if (gz) {
+		if (gzclose(gz) != Z_OK)
+			ret = 1;
+	} else {
+		if (fclose(f))
+			ret = 1;
+	}
+
+	if (ret)
+		sd_err("Failed to write '%s'", idx_path);
+err0:
+	free(idx_path);
+	return ret;
+}
+
+static int write_ifo(struct sd_writer *self)
+{
+	char *ifo_path = sd_aprintf("%s/%s.ifo", self->path, self->name);
+	FILE *f;
+	int ret = 0;
+
+	if (!ifo_path) {
+		sd_err("Failed to allocate path");
+		return 1;
+	}
+
+	f = fopen(ifo_path, "w");
+	if (!f) {
+		sd_err("Failed to open '%s': %s", ifo_path, strerror(errno));
+		free(ifo_path);
+		return 1;
+	}
+
+	fprintf(f, IFO_MAGIC);
+	fprintf(f, "version=2.4.2\n");
+	fprintf(f, "bookname=%s\n", self->book_name);
+	fprintf(f, "wordcount=%u\n", self->words_cnt);
+	fprintf(f, "idxfilesize=%u\n", self->idx_size);
+	fprintf(f, "sametypesequence=%c\n", self->entry_fmt);
+
+	if (fclose(f)) {
+		sd_err("Failed to write '%s': %s", ifo_path, strerror(errno));
+		ret = 1;
+	}
+
+	free(ifo_path);
+	return ret;
+}
+
+static void free_writer(struct sd_writer *self)
+{
+	unsigned int i;
+
+	deflateEnd(&self->stream);
+	fclose(self->chunks);
+
+	for (i = 0; i < self->words_cnt; i++)
+		free(self->words[i].word);
+
+	free(self->words);
+	free(self->chunk_sizes);
+	free(self->chunk);
+	free(self->out);
+	free(self->path);
+	free(self->name);
+	free(self);
+}
+
+int sd_writer_close(struct sd_writer *self)
+{
+	int ret = 1;
+
+	if (self->err)
+		goto exit;
+
+	if (!self->words_cnt) {
+		sd_err("Refusing to write empty dictionary");
+		goto exit;
+	}
+
+	/*
+	 * The ifo file is written last so that the dictionary does not appear
+	 * in lookups until all files are in place.
+	 */
+	if (write_dict_dz(self) || write_idx(self) || write_ifo(self))
+		goto exit;
+
+	ret = 0;
+exit:
+	free_writer(self);
+	return ret;
+}